@@ -1,7 +1,26 @@
 #include "g4a_common.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <cerrno>
+#include <cstring>
 #include <fstream>
-#include <regex>
+#include <sstream>
+#include <string_view>
+#include <unordered_map>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 void replace(std::string & str, const std::string & needle, const std::string & replacement) {
     size_t pos = 0;
@@ -102,101 +121,176 @@ std::map<std::string, int32_t> json_parse(const std::string & fname) {
     return result;
 }
 
-std::vector<gpt_vocab::id> gpt_tokenize_inner(const gpt_vocab & vocab, const std::string & text) {
-    std::vector<std::string> words;
-
-    // first split the text into words
-    {
-        std::string str = text;
-        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
-
-        std::regex re(pat);
-        std::smatch m;
-
-        while (std::regex_search(str, m, re)) {
-            for (auto x : m) {
-                words.push_back(x);
+// split text into words the same way the regex documented in g4a_common.hpp does
+// like std::regex in the "C" locale, only ASCII letters and digits are considered such
+static void gpt_split_words(std::string_view text, std::vector<std::string_view> & words) {
+    enum { WORD_ALPHA, WORD_DIGIT, WORD_OTHER, WORD_SPACE };
+    const auto classify = [](char c) {
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) return WORD_ALPHA;
+        if (c >= '0' && c <= '9') return WORD_DIGIT;
+        if (c == ' ' || (c >= '\t' && c <= '\r')) return WORD_SPACE;
+        return WORD_OTHER;
+    };
+
+    const size_t n = text.size();
+    size_t pos = 0;
+    while (pos < n) {
+        size_t end = pos;
+
+        // 's|'t|'re|'ve|'m|'ll|'d
+        if (text[pos] == '\'') {
+            for (const std::string_view suffix : {"s", "t", "re", "ve", "m", "ll", "d"}) {
+                if (text.substr(pos + 1, suffix.size()) == suffix) {
+                    end = pos + 1 + suffix.size();
+                    break;
+                }
             }
-            str = m.suffix();
         }
-    }
 
-    // find the longest tokens that form the words:
-    std::vector<gpt_vocab::id> tokens;
-    for (const auto & word : words) {
-        if (word.size() == 0) continue;
-
-        int i = 0;
-        int n = word.size();
-        while (i < n) {
-            int j = n;
-            while (j > i) {
-                auto it = vocab.token_to_id.find(word.substr(i, j-i));
-                if (it != vocab.token_to_id.end()) {
-                    tokens.push_back(it->second);
-                    i = j;
-                    break;
-                }
-                --j;
+        if (end == pos) {
+            // ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+
+            size_t start = pos;
+            if (text[pos] == ' ' && pos + 1 < n && classify(text[pos + 1]) != WORD_SPACE) {
+                start = pos + 1;
             }
-            if (i == n) {
-                break;
+            const auto cls = classify(text[start]);
+            end = start;
+            while (end < n && classify(text[end]) == cls) {
+                ++end;
             }
-            if (j == i) {
-                auto sub = word.substr(i, 1);
-                if (vocab.token_to_id.find(sub) != vocab.token_to_id.end()) {
-                    tokens.push_back(vocab.token_to_id.at(sub));
-                } else {
-                    fprintf(stderr, "%s: unknown token '%s'\n", __func__, sub.data());
-                }
-                ++i;
+            // \s+(?!\S)|\s+
+            if (cls == WORD_SPACE && end < n && end - pos > 1) {
+                --end;
             }
         }
+
+        words.push_back(text.substr(pos, end - pos));
+        pos = end;
     }
+}
 
-    return tokens;
+// byte pair encoding of a single word, using token ids as merge ranks
+static void gpt_bpe_word(const gpt_vocab & vocab, std::string_view word, std::string & scratch, std::vector<std::pair<size_t, size_t>> & parts, std::vector<gpt_vocab::id> & tokens) {
+    const auto lookup = [&](size_t offset, size_t size) -> gpt_vocab::id {
+        scratch.assign(word.data() + offset, size);
+        const auto it = vocab.token_index.find(scratch);
+        return it == vocab.token_index.end() ? -1 : it->second;
+    };
+
+    // common words are a single token
+    if (const auto id = lookup(0, word.size()); id >= 0) {
+        tokens.push_back(id);
+        return;
+    }
+
+    // start with single bytes, then merge the pair with the lowest rank until none is left
+    parts.clear();
+    for (size_t i = 0; i < word.size(); ++i) {
+        parts.emplace_back(i, 1);
+    }
+    while (parts.size() > 1) {
+        size_t best = 0;
+        gpt_vocab::id best_id = -1;
+        for (size_t i = 0; i + 1 < parts.size(); ++i) {
+            const auto id = lookup(parts[i].first, parts[i].second + parts[i + 1].second);
+            if (id >= 0 && (best_id < 0 || id < best_id)) {
+                best = i;
+                best_id = id;
+            }
+        }
+        if (best_id < 0) {
+            break;
+        }
+        parts[best].second += parts[best + 1].second;
+        parts.erase(parts.begin() + best + 1);
+    }
+
+    for (const auto & part : parts) {
+        const auto id = lookup(part.first, part.second);
+        if (id >= 0) {
+            tokens.push_back(id);
+        } else {
+            fprintf(stderr, "%s: unknown token '%s'\n", __func__, std::string(word.substr(part.first, part.second)).c_str());
+        }
+    }
 }
 
-std::string regex_escape(const std::string &s) {
-  static const std::regex metacharacters(R"([\.\^\$\-\+\(\)\[\]\{\}\|\?\*])");
-  return std::regex_replace(s, metacharacters, "\\$&");
+std::vector<gpt_vocab::id> gpt_tokenize_inner(const gpt_vocab & vocab, std::string_view text) {
+    // first split the text into words
+    std::vector<std::string_view> words;
+    gpt_split_words(text, words);
+
+    // then encode words, in parallel for long texts
+    const auto encode = [&vocab, &words](size_t first, size_t last, std::vector<gpt_vocab::id> & tokens) {
+        std::string scratch;
+        std::vector<std::pair<size_t, size_t>> parts;
+        for (size_t i = first; i != last; ++i) {
+            gpt_bpe_word(vocab, words[i], scratch, parts, tokens);
+        }
+    };
+
+    std::vector<gpt_vocab::id> tokens;
+    const size_t n_threads = std::min<size_t>(std::thread::hardware_concurrency(), text.size() / GPT_TOKENIZE_CHUNK_SIZE);
+    if (n_threads < 2) {
+        encode(0, words.size(), tokens);
+        return tokens;
+    }
+
+    std::vector<std::vector<gpt_vocab::id>> chunks(n_threads);
+    std::vector<std::thread> workers;
+    workers.reserve(n_threads);
+    for (size_t i = 0; i < n_threads; ++i) {
+        workers.emplace_back(encode, words.size()*i/n_threads, words.size()*(i + 1)/n_threads, std::ref(chunks[i]));
+    }
+    for (size_t i = 0; i < n_threads; ++i) {
+        workers[i].join();
+        tokens.insert(tokens.end(), chunks[i].begin(), chunks[i].end());
+    }
+
+    return tokens;
 }
 
 std::vector<gpt_vocab::id> gpt_tokenize(const gpt_vocab & vocab, const std::string & text) {
-    // Generate the subpattern from the special_tokens vector if it's not empty
-    if (!vocab.special_tokens.empty()) {
-        std::vector<gpt_vocab::id> out;
-        std::vector<std::string> chunks;
-        std::string str = text;
-        std::string special_tokens_subpattern;
-        for (const auto &token : vocab.special_tokens) {
-            if (!special_tokens_subpattern.empty()) {
-                special_tokens_subpattern += "|";
+    std::vector<gpt_vocab::id> out;
+    std::string_view str = text;
+
+    // split off special tokens, taking the first one listed if multiple start at the same position
+    while (!str.empty()) {
+        size_t pos = str.npos;
+        const std::string * special = nullptr;
+        for (const auto & token : vocab.special_tokens) {
+            if (token.empty()) continue;
+            const auto token_pos = str.find(token);
+            if (token_pos < pos) {
+                pos = token_pos;
+                special = &token;
             }
-            special_tokens_subpattern += regex_escape(token);
         }
-        std::regex re(special_tokens_subpattern);
-        std::smatch m;
-        while (std::regex_search(str, m, re)) {
-            auto tok = vocab.token_to_id.find(m.str());
-            if (tok != vocab.token_to_id.end()) {
-                auto tokid = tok->second;
-                auto pfxtoks = gpt_tokenize_inner(vocab, m.prefix());
-                out.insert(out.end(), pfxtoks.begin(), pfxtoks.end());
-                out.push_back(tokid);
-                str = m.suffix();
-            }
+        if (!special) {
+            break;
         }
-        if (!str.empty()) {
-            auto tokrest = gpt_tokenize_inner(vocab, str);
-            out.insert(out.end(), tokrest.begin(), tokrest.end());
+
+        const auto pfxtoks = gpt_tokenize_inner(vocab, str.substr(0, pos));
+        out.insert(out.end(), pfxtoks.begin(), pfxtoks.end());
+        const auto tok = vocab.token_index.find(*special);
+        if (tok != vocab.token_index.end()) {
+            out.push_back(tok->second);
         }
-        return out;
-    } else {
-        return gpt_tokenize_inner(vocab, text);
+        str = str.substr(pos + special->size());
     }
+
+    const auto tokrest = gpt_tokenize_inner(vocab, str);
+    out.insert(out.end(), tokrest.begin(), tokrest.end());
+    return out;
 }
 
+void gpt_vocab_finalize(gpt_vocab & vocab) {
+    vocab.token_index.clear();
+    vocab.token_index.reserve(vocab.token_to_id.size());
+    for (const auto & kv : vocab.token_to_id) {
+        vocab.token_index.emplace(kv.first, kv.second);
+    }
+}
 
 bool gpt_vocab_init(const std::string & fname, gpt_vocab & vocab) {
     printf("%s: loading vocab from '%s'\n", __func__, fname.c_str());
@@ -207,6 +301,8 @@ bool gpt_vocab_init(const std::string & fname, gpt_vocab & vocab) {
         vocab.id_to_token[kv.second] = kv.first;
     }
 
+    gpt_vocab_finalize(vocab);
+
     printf("%s: vocab size = %d\n", __func__, (int) vocab.token_to_id.size());
 
     // print the vocabulary
@@ -217,65 +313,156 @@ bool gpt_vocab_init(const std::string & fname, gpt_vocab & vocab) {
     return true;
 }
 
-gpt_vocab::id gpt_sample_top_k_top_p(
+bool gpt_mmap::map(const std::string & fname, bool prefetch, bool lock) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(fname.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER file_size;
+    GetFileSizeEx(file, &file_size);
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping) {
+        return false;
+    }
+    addr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!addr) {
+        return false;
+    }
+    size = file_size.QuadPart;
+    (void) prefetch;
+    if (lock && !VirtualLock(addr, size)) {
+        fprintf(stderr, "%s: warning: failed to lock %zu bytes of '%s' in memory\n", __func__, size, fname.c_str());
+    }
+#else
+    const int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    size = st.st_size;
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (prefetch) flags |= MAP_POPULATE;
+#endif
+    addr = mmap(NULL, size, PROT_READ, flags, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        addr = nullptr;
+        return false;
+    }
+    if (prefetch) {
+        posix_madvise(addr, size, POSIX_MADV_WILLNEED);
+    }
+    if (lock && mlock(addr, size) != 0) {
+        fprintf(stderr, "%s: warning: failed to lock %zu bytes of '%s' in memory: %s\n", __func__, size, fname.c_str(), strerror(errno));
+    }
+#endif
+    return true;
+}
+
+gpt_mmap::~gpt_mmap() {
+    if (!addr) {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(addr);
+#else
+    munmap(addr, size);
+#endif
+}
+
+std::vector<uint32_t> gpt_rng_save(const std::mt19937 & rng) {
+    std::stringstream ss;
+    ss << rng;
+
+    std::vector<uint32_t> state;
+    state.reserve(std::mt19937::state_size + 1);
+    for (uint32_t word; ss >> word;) {
+        state.push_back(word);
+    }
+    return state;
+}
+
+bool gpt_rng_load(std::mt19937 & rng, const std::vector<uint32_t> & state) {
+    std::stringstream ss;
+    for (const auto word : state) {
+        ss << word << ' ';
+    }
+
+    ss >> rng;
+    return !ss.fail();
+}
+
+gpt_vocab::id gpt_sampler::sample(
         const size_t actualVocabSize,
         const int32_t * last_n_tokens_data,
         int   last_n_tokens_size,
-        const std::vector<float> logits,
+        const float * logits,
         int    top_k,
         double top_p,
         double temp,
         float repeat_penalty,
         std::mt19937 & rng) {
-    int n_logits = actualVocabSize;
-
-    const auto last_n_tokens = std::vector<int32_t>(last_n_tokens_data, last_n_tokens_data + last_n_tokens_size);
-    const auto * plogits = logits.data() + logits.size() - n_logits;
+    const int n_logits = actualVocabSize;
+    top_k = std::clamp(top_k, 1, n_logits);
 
-    std::vector<std::pair<double, gpt_vocab::id>> logits_id;
-    logits_id.reserve(n_logits);
+    scores.resize(n_logits);
+    ids.resize(n_logits);
+    penalized.resize(n_logits);
 
+    // scale logits by temperature, written so it can be vectorized
     {
         const float scale = 1.0f/temp;
+        float * pscores = scores.data();
         for (int i = 0; i < n_logits; ++i) {
-            // repetition penalty from ctrl paper (https://arxiv.org/abs/1909.05858)
-            // credit https://github.com/facebookresearch/llama/compare/main...shawwn:llama:main
-            if (std::find(last_n_tokens.begin(), last_n_tokens.end(), i) != last_n_tokens.end()) {
-                // if score < 0 then repetition penalty has to multiplied to reduce the previous token probability
-                if (plogits[i] < 0.0f) {
-                    logits_id.push_back(std::make_pair(plogits[i]*scale*repeat_penalty, i));
-                } else {
-                    logits_id.push_back(std::make_pair(plogits[i]*scale/repeat_penalty, i));
-                }
-            } else {
-                logits_id.push_back(std::make_pair(plogits[i]*scale, i));
-            }
+            pscores[i] = logits[i]*scale;
         }
     }
 
-    // find the top K tokens
-    std::partial_sort(
-            logits_id.begin(),
-            logits_id.begin() + top_k, logits_id.end(),
-            [](const std::pair<double, gpt_vocab::id> & a, const std::pair<double, gpt_vocab::id> & b) {
-        return a.first > b.first;
-    });
-
-    logits_id.resize(top_k);
+    // repetition penalty from ctrl paper (https://arxiv.org/abs/1909.05858)
+    // credit https://github.com/facebookresearch/llama/compare/main...shawwn:llama:main
+    for (int i = 0; i < last_n_tokens_size; ++i) {
+        const auto id = last_n_tokens_data[i];
+        if (id < 0 || id >= n_logits || penalized[id]) continue;
+        penalized[id] = true;
+        // if score < 0 then repetition penalty has to multiplied to reduce the previous token probability
+        if (logits[id] < 0.0f) {
+            scores[id] *= repeat_penalty;
+        } else {
+            scores[id] /= repeat_penalty;
+        }
+    }
+    for (int i = 0; i < last_n_tokens_size; ++i) {
+        const auto id = last_n_tokens_data[i];
+        if (id >= 0 && id < n_logits) penalized[id] = false;
+    }
 
-    double maxl = -INFINITY;
-    for (const auto & kv : logits_id) {
-        maxl = std::max(maxl, kv.first);
+    // find the top K tokens
+    for (int i = 0; i < n_logits; ++i) {
+        ids[i] = i;
     }
+    const auto compare = [this] (gpt_vocab::id a, gpt_vocab::id b) {
+        return scores[a] > scores[b];
+    };
+    std::nth_element(ids.begin(), ids.begin() + top_k - 1, ids.end(), compare);
+    std::sort(ids.begin(), ids.begin() + top_k, compare);
+
+    const double maxl = scores[ids[0]];
 
     // compute probs for the top K tokens
-    std::vector<double> probs;
-    probs.reserve(logits_id.size());
+    probs.resize(top_k);
 
     double sum = 0.0;
-    for (const auto & kv : logits_id) {
-        double p = exp(kv.first - maxl);
-        probs.push_back(p);
+    for (int i = 0; i < top_k; ++i) {
+        const double p = exp(scores[ids[i]] - maxl);
+        probs[i] = p;
         sum += p;
     }
 
@@ -291,7 +478,6 @@ gpt_vocab::id gpt_sample_top_k_top_p(
             if (cumsum >= top_p) {
                 top_k = i + 1;
                 probs.resize(top_k);
-                logits_id.resize(top_k);
                 break;
             }
         }
@@ -302,14 +488,25 @@ gpt_vocab::id gpt_sample_top_k_top_p(
         }
     }
 
-    //printf("\n");
-    //for (int i = 0; i < (int) probs.size(); i++) {
-    //    printf("%d: '%s' %f\n", i, vocab.id_to_token.at(logits_id[i].second).c_str(), probs[i]);
-    //}
-    //exit(0);
-
-    std::discrete_distribution<> dist(probs.begin(), probs.end());
-    int idx = dist(rng);
+    // pick a token according to the probs
+    double r = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+    for (int i = 0; i < (int) probs.size(); i++) {
+        r -= probs[i];
+        if (r < 0.0) return ids[i];
+    }
+    return ids[probs.size() - 1];
+}
 
-    return logits_id[idx].second;
+gpt_vocab::id gpt_sample_top_k_top_p(
+        const size_t actualVocabSize,
+        const int32_t * last_n_tokens_data,
+        int   last_n_tokens_size,
+        const std::vector<float> & logits,
+        int    top_k,
+        double top_p,
+        double temp,
+        float repeat_penalty,
+        std::mt19937 & rng) {
+    gpt_sampler sampler;
+    return sampler.sample(actualVocabSize, last_n_tokens_data, last_n_tokens_size, logits.data() + logits.size() - actualVocabSize, top_k, top_p, temp, repeat_penalty, rng);
 }
@@ -4,6 +4,7 @@
 
 #include <string>
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <random>
 #include <thread>
@@ -44,6 +45,7 @@ struct gpt_vocab {
 
     std::map<token, id> token_to_id;
     std::map<id, token> id_to_token;
+    std::unordered_map<token, id> token_index; // hashed copy of token_to_id used by gpt_tokenize(), see gpt_vocab_finalize()
     std::vector<std::string> special_tokens;
 
     void add_special_token(const std::string &token) {
@@ -56,7 +58,11 @@ void replace(std::string & str, const std::string & needle, const std::string &
 // poor-man's JSON parsing
 std::map<std::string, int32_t> json_parse(const std::string & fname);
 
-// split text into tokens
+// texts longer than this many bytes per thread are tokenized in parallel
+#define GPT_TOKENIZE_CHUNK_SIZE 16384
+
+// split text into words using a hand written equivalent of the regex below, then byte pair encode them
+// token ids are used as merge ranks, which matches the merge order of GPT-2 style vocabularies
 //
 // ref: https://github.com/openai/gpt-2/blob/a74da5d99abaaba920de8131d64da2862a8f213b/src/encoder.py#L53
 //
@@ -68,21 +74,60 @@ std::map<std::string, int32_t> json_parse(const std::string & fname);
 //
 std::vector<gpt_vocab::id> gpt_tokenize(const gpt_vocab & vocab, const std::string & text);
 
+// must be called once the vocab has been filled, before tokenizing
+void gpt_vocab_finalize(gpt_vocab & vocab);
+
 // load the tokens from encoder.json
 bool gpt_vocab_init(const std::string & fname, gpt_vocab & vocab);
 
+// read-only mapping of a whole file, pages are shared with all other processes mapping it
+struct gpt_mmap {
+    void * addr = nullptr;
+    size_t size = 0;
+
+    gpt_mmap() = default;
+    gpt_mmap(const gpt_mmap &) = delete;
+    ~gpt_mmap();
+
+    // prefetch asks the OS to read the file ahead, lock keeps it in memory (failing to lock only prints a warning)
+    bool map(const std::string & fname, bool prefetch, bool lock);
+};
+
+// compact binary representation of a random number generator's state, made of the numbers of its textual one
+std::vector<uint32_t> gpt_rng_save(const std::mt19937 & rng);
+bool gpt_rng_load(std::mt19937 & rng, const std::vector<uint32_t> & state);
+
 // sample next token given probabilities for each embedding
 //
 //   - consider only the top K tokens
 //   - from them, consider only the top tokens with cumulative probability > P
 //
-// TODO: not sure if this implementation is correct
+// keeps its buffers between calls, so it should be kept around for as long as tokens are sampled
 //
+struct gpt_sampler {
+    std::vector<float> scores;
+    std::vector<gpt_vocab::id> ids;
+    std::vector<double> probs;
+    std::vector<bool> penalized;
+
+    gpt_vocab::id sample(
+            const size_t actualVocabSize,
+            const int32_t * last_n_tokens_data,
+            int   last_n_tokens_size,
+            const float * logits,
+            int    top_k,
+            double top_p,
+            double temp,
+            float repeat_penalty,
+            std::mt19937 & rng);
+};
+
+// same as gpt_sampler::sample() without keeping buffers
 gpt_vocab::id gpt_sample_top_k_top_p(
         const size_t actualVocabSize,
         const int32_t * last_n_tokens_data,
         int   last_n_tokens_size,
-        const std::vector<float> logits,
+        const std::vector<float> & logits,
         int    top_k,
         double top_p,
         double temp,
@@ -2,6 +2,7 @@
 
 #include "../g4a_common.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstdio>
@@ -21,18 +22,19 @@ unsigned long long operator ""_MiB(unsigned long long bytes) {
     return bytes*1024*1024;
 }
 
-static bool kv_cache_init(
+bool gptj_kv_cache_init(
         const struct gptj_hparams & hparams,
              struct gptj_kv_cache & cache,
                          ggml_type   wtype,
-                               int   n_ctx) {
+                               int   n_ctx,
+                               int   n_ctx_max) {
     const int n_embd  = hparams.n_embd;
     const int n_layer = hparams.n_layer;
 
     const int64_t n_mem      = (int64_t)n_layer*n_ctx;
     const int64_t n_elements = n_embd*n_mem;
 
-    cache.buf.resize(2u*n_elements*ggml_type_size(wtype) + 2_MiB);
+    cache.buf.resize(2u*n_elements*ggml_type_size(wtype)/ggml_blck_size(wtype) + 2_MiB);
 
     struct ggml_init_params params;
     params.mem_size   = cache.buf.size;
@@ -49,11 +51,88 @@ static bool kv_cache_init(
     cache.k = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
     cache.v = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
 
+    cache.n         = 0;
+    cache.n_saved   = 0;
+    cache.n_ctx     = n_ctx;
+    cache.n_ctx_max = std::max(n_ctx, n_ctx_max);
+
+    return true;
+}
+
+// Size of one token's keys or values of a single layer in the cache, which may be quantized
+static size_t gptj_kv_row_size(const ggml_tensor * t, int n_embd) {
+    return ggml_type_size(t->type)*n_embd/ggml_blck_size(t->type);
+}
+
+// Removes tokens in range [p0, p1) from the cache, moving all tokens following them into their place
+void gptj_kv_cache_erase(const gptj_hparams & hparams, gptj_kv_cache & cache, int p0, int p1) {
+    const int n_embd  = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
+    const int n_ctx   = cache.n_ctx;
+
+    // Only tokens actually in the cache need to be moved
+    p1 = std::min(p1, cache.n);
+    if (p0 >= p1) return;
+    const int n_move = cache.n - p1;
+    const size_t row_size = gptj_kv_row_size(cache.k, n_embd);
+
+    // Move rows of kept tokens into place
+    for (int il = 0; il < n_layer; il++) {
+        for (auto t : {cache.k, cache.v}) {
+            auto layer = reinterpret_cast<uint8_t*>(t->data) + size_t(il)*n_ctx*row_size;
+            memmove(layer + p0*row_size, layer + p1*row_size, n_move*row_size);
+        }
+    }
+
+    cache.n -= p1 - p0;
+    cache.n_saved = std::min(cache.n_saved, p0);
+}
+
+// Initializes cache with room for given amount of tokens as a copy of the tokens in src, as far as they fit
+bool gptj_kv_cache_copy(const gptj_hparams & hparams, const gptj_kv_cache & src, gptj_kv_cache & cache, int n_ctx) {
+    const int n_embd  = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
+
+    if (!gptj_kv_cache_init(hparams, cache, src.k->type, n_ctx, src.n_ctx_max)) {
+        return false;
+    }
+    cache.n = std::min(src.n, n_ctx);
+
+    // Copy rows of kept tokens layer by layer
+    const size_t row_size = gptj_kv_row_size(src.k, n_embd);
+    for (int il = 0; il < n_layer; il++) {
+        for (auto [from, to] : {std::pair{src.k, cache.k}, std::pair{src.v, cache.v}}) {
+            memcpy(reinterpret_cast<uint8_t*>(to->data) + size_t(il)*n_ctx*row_size,
+                   reinterpret_cast<uint8_t*>(from->data) + size_t(il)*src.n_ctx*row_size,
+                   cache.n*row_size);
+        }
+    }
+
+    return true;
+}
+
+// Reallocates the cache with room for given amount of tokens, keeping the ones it contains as far as they fit
+bool gptj_kv_cache_resize(const gptj_hparams & hparams, gptj_kv_cache & cache, int n_ctx) {
+    gptj_kv_cache resized;
+    if (!gptj_kv_cache_copy(hparams, cache, resized, n_ctx)) {
+        return false;
+    }
+
+    // Swap old cache out, it is freed along with resized
+    std::swap(cache.k, resized.k);
+    std::swap(cache.v, resized.v);
+    std::swap(cache.ctx, resized.ctx);
+    std::swap(cache.buf.addr, resized.buf.addr);
+    std::swap(cache.buf.size, resized.buf.size);
+    cache.n       = resized.n;
+    cache.n_saved = std::min(cache.n_saved, cache.n);
+    cache.n_ctx   = resized.n_ctx;
+
     return true;
 }
 
 // load the model's weights from a stream
-bool gptj_model_load(const std::string &fname, std::istream &fin, gptj_model & model, gpt_vocab & vocab) {
+bool gptj_model_load(const std::string &fname, std::istream &fin, gptj_model & model, gpt_vocab & vocab, bool use_mmap, bool use_mlock) {
     printf("%s: loading model from '%s' - please wait ...\n", __func__, fname.c_str());
 
     // verify magic
@@ -109,6 +188,8 @@ bool gptj_model_load(const std::string &fname, std::istream &fin, gptj_model & m
             vocab.token_to_id[word] = i;
             vocab.id_to_token[i] = word;
         }
+
+        gpt_vocab_finalize(vocab);
     }
 
     // for the big tensors, we have the option to store the data in 16-bit floats or quantized
@@ -132,13 +213,13 @@ bool gptj_model_load(const std::string &fname, std::istream &fin, gptj_model & m
     auto & ctx = model.ctx;
 
     size_t ctx_size = 0;
+    size_t ctx_overhead = 0;
 
     {
         const auto & hparams = model.hparams;
 
         const int n_embd  = hparams.n_embd;
         const int n_layer = hparams.n_layer;
-        const int n_ctx   = hparams.n_ctx;
         const int n_vocab = hparams.n_vocab;
 
         ctx_size += n_embd*ggml_type_sizef(GGML_TYPE_F32); // ln_f_g
@@ -164,19 +245,27 @@ bool gptj_model_load(const std::string &fname, std::istream &fin, gptj_model & m
         ctx_size += n_layer*(4*n_embd*n_embd*ggml_type_sizef(wtype));         // c_mlp_proj_w
         ctx_size += n_layer*(         n_embd*ggml_type_sizef(GGML_TYPE_F32)); // c_mlp_proj_b
 
-        ctx_size += n_ctx*n_layer*n_embd*ggml_type_sizef(GGML_TYPE_F32); // memory_k
-        ctx_size += n_ctx*n_layer*n_embd*ggml_type_sizef(GGML_TYPE_F32); // memory_v
-
-        ctx_size += (5 + 10*n_layer)*256; // object overhead
+        ctx_overhead = (5 + 10*n_layer)*256;
+        ctx_size += ctx_overhead; // object overhead
 
         printf("%s: ggml ctx size = %6.2f MB\n", __func__, ctx_size/(1024.0*1024.0));
     }
 
+    // map the model file, tensors will point into the mapping instead of being read
+    if (use_mmap) {
+        model.mapping = std::make_unique<gpt_mmap>();
+        if (!model.mapping->map(fname, true, use_mlock)) {
+            fprintf(stderr, "%s: failed to map '%s', reading it instead\n", __func__, fname.c_str());
+            model.mapping = nullptr;
+        }
+    }
+
     // create the ggml context
     {
         struct ggml_init_params params = {
-            .mem_size   = ctx_size,
+            .mem_size   = model.mapping ? ctx_overhead : ctx_size,
             .mem_buffer = NULL,
+            .no_alloc   = bool(model.mapping),
         };
 
         model.ctx = ggml_init(params);
@@ -249,20 +338,6 @@ bool gptj_model_load(const std::string &fname, std::istream &fin, gptj_model & m
         }
     }
 
-    // key + value memory
-    {
-        const auto & hparams = model.hparams;
-
-        if (!kv_cache_init(hparams, model.kv_self, GGML_TYPE_F32, model.hparams.n_ctx)) {
-            fprintf(stderr, "%s: kv_cache_init() failed for self-attention cache\n", __func__);
-            ggml_free(ctx);
-            return false;
-        }
-
-        const size_t memory_size = ggml_nbytes(model.kv_self.k) + ggml_nbytes(model.kv_self.v);
-        printf("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
-    }
-
     // load weights
     {
         int n_tensors = 0;
@@ -335,7 +410,23 @@ bool gptj_model_load(const std::string &fname, std::istream &fin, gptj_model & m
                 return false;
             }
 
-            fin.read(reinterpret_cast<char *>(tensor->data), ggml_nbytes(tensor));
+            if (model.mapping) {
+                const size_t offset = fin.tellg();
+                if (offset + ggml_nbytes(tensor) > model.mapping->size) {
+                    fprintf(stderr, "%s: tensor '%s' exceeds end of model file\n", __func__, name.data());
+                    return false;
+                }
+                // point tensor into mapping if its data is aligned to its elements, copy it otherwise
+                auto data = static_cast<uint8_t *>(model.mapping->addr) + offset;
+                if (offset % sizeof(float) == 0) {
+                    tensor->data = data;
+                } else {
+                    tensor->data = model.unaligned_data.emplace_back(data, data + ggml_nbytes(tensor)).data();
+                }
+                fin.seekg(ggml_nbytes(tensor), std::ios::cur);
+            } else {
+                fin.read(reinterpret_cast<char *>(tensor->data), ggml_nbytes(tensor));
+            }
 
             //printf("%42s - [%5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ftype == 0 ? "float" : "f16", ggml_nbytes(tensor)/1024.0/1024.0);
             total_size += ggml_nbytes(tensor);
@@ -354,14 +445,14 @@ bool gptj_model_load(const std::string &fname, std::istream &fin, gptj_model & m
 }
 
 // load the model's weights from a file path
-bool gptj_model_load(const std::string & fname, gptj_model & model, gpt_vocab & vocab) {
+bool gptj_model_load(const std::string & fname, gptj_model & model, gpt_vocab & vocab, bool use_mmap, bool use_mlock) {
     auto fin = std::ifstream(fname, std::ios::binary);
     if (!fin) {
         fprintf(stderr, "%s: failed to open '%s'\n", __func__, fname.c_str());
         return false;
     }
 
-    bool loaded = gptj_model_load(fname, fin, model, vocab);
+    bool loaded = gptj_model_load(fname, fin, model, vocab, use_mmap, use_mlock);
     fin.close();
     return loaded;
 }
@@ -373,46 +464,62 @@ bool gptj_model_load(const std::string & fname, gptj_model & model, gpt_vocab &
 //   - n_past:    the context size so far
 //   - embd_inp:  the embeddings of the tokens in the context
 //   - embd_w:    the predicted logits for the next token
+//   - all_logits: return logits of all given tokens instead of just the last one
 //
 // The GPT-J model requires about 16MB of memory per input token.
 //
 bool gptj_eval(
-        gptj_model & model,
+        const gptj_model & model,
+              gptj_kv_cache & kv_self,
+              gptj_buffer & buf,
         const int n_threads,
         const int n_past,
         const std::vector<gpt_vocab::id> & embd_inp,
               std::vector<float>         & embd_w,
-              size_t                     & mem_per_token) {
+              size_t                     & mem_per_token,
+              bool                         all_logits) {
     const int N = embd_inp.size();
 
     const auto & hparams = model.hparams;
 
     const int n_embd  = hparams.n_embd;
     const int n_layer = hparams.n_layer;
-    const int n_ctx   = hparams.n_ctx;
     const int n_head  = hparams.n_head;
     const int n_vocab = hparams.n_vocab;
     const int n_rot   = hparams.n_rot;
 
+    // grow kv cache geometrically if it's too small
+    // tokens from n_past on are (re)written
+    kv_self.n_saved = std::min(kv_self.n_saved, n_past);
+
+    if (n_past + N > kv_self.n_ctx) {
+        const int n_ctx_new = std::min(kv_self.n_ctx_max, std::max(n_past + N, 2*kv_self.n_ctx));
+        if (n_past + N > n_ctx_new || !gptj_kv_cache_resize(hparams, kv_self, n_ctx_new)) {
+            fprintf(stderr, "%s: not enough space in kv cache for %d tokens\n", __func__, n_past + N);
+            return false;
+        }
+    }
+    const int n_ctx = kv_self.n_ctx;
+
     static size_t buf_size = 1024_MiB;
-    if (!model.buf.addr || model.buf.size < buf_size)
-        model.buf.resize(buf_size);
+    if (!buf.addr || buf.size < buf_size)
+        buf.resize(buf_size);
 
-    if (mem_per_token > 0 && mem_per_token*N > model.buf.size) {
+    if (mem_per_token > 0 && mem_per_token*N > buf.size) {
         const size_t buf_size_new = 1.1*(mem_per_token*N); // add 10% to account for ggml object overhead
-        printf("\n%s: reallocating buffer from %zu to %zu bytes\n", __func__, model.buf.size, buf_size_new);
+        printf("\n%s: reallocating buffer from %zu to %zu bytes\n", __func__, buf.size, buf_size_new);
 
         // reallocate
-        model.buf.resize(buf_size_new);
-        if (model.buf.addr == nullptr) {
-            fprintf(stderr, "%s: failed to allocate %zu bytes\n", __func__, model.buf.size);
+        buf.resize(buf_size_new);
+        if (buf.addr == nullptr) {
+            fprintf(stderr, "%s: failed to allocate %zu bytes\n", __func__, buf.size);
             return false;
         }
     }
 
     struct ggml_init_params params = {
-        .mem_size   = model.buf.size,
-        .mem_buffer = model.buf.addr,
+        .mem_size   = buf.size,
+        .mem_buffer = buf.addr,
     };
 
     struct ggml_context * ctx0 = ggml_init(params);
@@ -424,6 +531,23 @@ bool gptj_eval(
     // wte
     struct ggml_tensor * inpL = ggml_get_rows(ctx0, model.wte, embd);
 
+    // Quantized caches can't be permuted or roped directly, so their rows are dequantized first
+    const size_t kv_row_size = gptj_kv_row_size(kv_self.k, n_embd);
+    struct ggml_tensor * kv_rows = nullptr;
+    if (ggml_is_quantized(kv_self.k->type)) {
+        kv_rows = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_past + N);
+        for (int i = 0; i < n_past + N; i++) {
+            reinterpret_cast<int32_t *>(kv_rows->data)[i] = i;
+        }
+    }
+    auto kv_view = [&] (struct ggml_tensor * t, int il) {
+        struct ggml_tensor * view = ggml_view_1d(ctx0, t, (n_past + N)*n_embd, il*n_ctx*kv_row_size);
+        if (kv_rows) {
+            view = ggml_get_rows(ctx0, ggml_reshape_2d(ctx0, view, n_embd, n_past + N), kv_rows);
+        }
+        return view;
+    };
+
     for (int il = 0; il < n_layer; ++il) {
         struct ggml_tensor * cur;
 
@@ -449,8 +573,8 @@ bool gptj_eval(
 
             // store key and value to memory
             if (N >= 1) {
-                struct ggml_tensor * k = ggml_view_1d(ctx0, model.kv_self.k, N*n_embd, (ggml_element_size(model.kv_self.k)*n_embd)*(il*n_ctx + n_past));
-                struct ggml_tensor * v = ggml_view_1d(ctx0, model.kv_self.v, N*n_embd, (ggml_element_size(model.kv_self.v)*n_embd)*(il*n_ctx + n_past));
+                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_embd, kv_row_size*(il*n_ctx + n_past));
+                struct ggml_tensor * v = ggml_view_1d(ctx0, kv_self.v, N*n_embd, kv_row_size*(il*n_ctx + n_past));
 
                 ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur, k));
                 ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcur, v));
@@ -471,7 +595,7 @@ bool gptj_eval(
                 ggml_permute(ctx0,
                         ggml_rope(ctx0,
                             ggml_reshape_3d(ctx0,
-                                ggml_view_1d(ctx0, model.kv_self.k, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(model.kv_self.k)*n_embd),
+                                kv_view(kv_self.k, il),
                                 n_embd/n_head, n_head, n_past + N),
                             n_past, n_rot, 1),
                         0, 2, 1, 3);
@@ -497,10 +621,10 @@ bool gptj_eval(
                 ggml_cpy(ctx0,
                         ggml_permute(ctx0,
                             ggml_reshape_3d(ctx0,
-                                ggml_view_1d(ctx0, model.kv_self.v, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(model.kv_self.v)*n_embd),
+                                kv_view(kv_self.v, il),
                                 n_embd/n_head, n_head, n_past + N),
                             1, 2, 0, 3),
-                        ggml_new_tensor_3d(ctx0, model.kv_self.v->type, n_past + N, n_embd/n_head, n_head));
+                        ggml_new_tensor_3d(ctx0, kv_rows ? GGML_TYPE_F32 : kv_self.v->type, n_past + N, n_embd/n_head, n_head));
 
             // KQV = transpose(V) * KQ_soft_max
             struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_trans, KQ_soft_max);
@@ -587,12 +711,17 @@ bool gptj_eval(
     //    ggml_graph_dump_dot(&gf, NULL, "gpt-2.dot");
     //}
 
-    //embd_w.resize(n_vocab*N);
-    //memcpy(embd_w.data(), ggml_get_data(inpL), sizeof(float)*n_vocab*N);
+    if (all_logits) {
+        // return result for all tokens
+        embd_w.resize(n_vocab*N);
+        memcpy(embd_w.data(), ggml_get_data(inpL), sizeof(float)*n_vocab*N);
+    } else {
+        // return result for just the last token
+        embd_w.resize(n_vocab);
+        memcpy(embd_w.data(), (float *) ggml_get_data(inpL) + (n_vocab*(N-1)), sizeof(float)*n_vocab);
+    }
 
-    // return result for just the last token
-    embd_w.resize(n_vocab);
-    memcpy(embd_w.data(), (float *) ggml_get_data(inpL) + (n_vocab*(N-1)), sizeof(float)*n_vocab);
+    kv_self.n = n_past + N;
 
     if (mem_per_token == 0 && N != 0) {
         mem_per_token = ggml_used_mem(ctx0)/N;
@@ -604,109 +733,230 @@ bool gptj_eval(
     return true;
 }
 
-#define GPTJ_MAX_RNG_STATE 64*1024
+// the state consists of 32 bit words (rng state size, rng state, kv cache type, amount of tokens in kv cache)
+// followed by the first kv_self.n tokens of the kv cache
+// kv cache type in state header if the kv cache has been quantized to blocks of a scale followed by 8 bit values
+static const uint32_t gptj_state_kv_q8 = 0x10000;
+static const size_t gptj_q8_block_size = 32;
 
-size_t gptj_get_state_size(const gptj_model &model)
+static bool gptj_state_quantizable(const gptj_kv_cache &kv_self)
 {
-    // we don't know size of rng until we actually serialize it. so reserve more than enough memory for its serialized state.
-    // for reference, std::mt19937(1337) serializes to 6701 bytes.
-    const size_t s_rng_size        = sizeof(size_t);
-    const size_t s_rng             = GPTJ_MAX_RNG_STATE;
-    const size_t s_kv_size         = sizeof(size_t);
-    const size_t s_kv_ntok         = sizeof(int);
-    const size_t s_kv              = model.kv_self.buf.size;
-    const size_t s_total = (
-        + s_rng_size
-        + s_rng
-        + s_kv_size
-        + s_kv_ntok
-        + s_kv
-    );
-    fflush(stdout);
-    return s_total;
+    return kv_self.k->type == GGML_TYPE_F32 || kv_self.k->type == GGML_TYPE_F16;
 }
 
-size_t gptj_copy_state_data(const gptj_model &model, const std::mt19937 &rng, uint8_t *dest)
+static size_t gptj_q8_size(size_t n)
 {
-    uint8_t * out = dest;
-    fflush(stdout);
-    // copy rng
-    {
-        std::stringstream rng_ss;
-        rng_ss << rng;
-
-        const size_t rng_size = rng_ss.str().size();
-        char rng_buf[GPTJ_MAX_RNG_STATE];
-
-        memset(&rng_buf[0], 0, GPTJ_MAX_RNG_STATE);
-        memcpy(&rng_buf[0], rng_ss.str().data(), rng_ss.str().size());
+    return (n + gptj_q8_block_size - 1)/gptj_q8_block_size*(sizeof(float) + gptj_q8_block_size);
+}
 
-        memcpy(out, &rng_size,   sizeof(rng_size));   out += sizeof(rng_size);
-        memcpy(out, &rng_buf[0], GPTJ_MAX_RNG_STATE); out += GPTJ_MAX_RNG_STATE;
+static void gptj_quantize_q8(ggml_type type, const uint8_t *src, size_t n, uint8_t *dst)
+{
+    std::vector<float> block(gptj_q8_block_size);
+    for (size_t i = 0; i < n; i += gptj_q8_block_size) {
+        const size_t n_block = std::min(gptj_q8_block_size, n - i);
+        float amax = 0.0f;
+        for (size_t j = 0; j < n_block; j++) {
+            block[j] = type == GGML_TYPE_F16 ? ggml_fp16_to_fp32(reinterpret_cast<const ggml_fp16_t *>(src)[i + j])
+                                             : reinterpret_cast<const float *>(src)[i + j];
+            amax = std::max(amax, std::fabs(block[j]));
+        }
+        const float scale = amax/127.0f;
+        const float iscale = scale != 0.0f ? 1.0f/scale : 0.0f;
+        memcpy(dst, &scale, sizeof(scale)); dst += sizeof(scale);
+        for (size_t j = 0; j < gptj_q8_block_size; j++) {
+            *dst++ = uint8_t(j < n_block ? int8_t(std::round(block[j]*iscale)) : 0);
+        }
     }
+}
 
-    // copy kv cache
-    {
-        const size_t kv_size = model.kv_self.buf.size;
-        const int    kv_ntok = model.kv_self.n;
-
-        memcpy(out, &kv_size, sizeof(kv_size)); out += sizeof(kv_size);
-        memcpy(out, &kv_ntok, sizeof(kv_ntok)); out += sizeof(kv_ntok);
-
-        if (kv_size) {
-            memcpy(out, model.kv_self.buf.addr, kv_size); out += kv_size;
+static void gptj_dequantize_q8(ggml_type type, const uint8_t *src, size_t n, uint8_t *dst)
+{
+    for (size_t i = 0; i < n; i += gptj_q8_block_size) {
+        const size_t n_block = std::min(gptj_q8_block_size, n - i);
+        float scale;
+        memcpy(&scale, src, sizeof(scale)); src += sizeof(scale);
+        for (size_t j = 0; j < n_block; j++) {
+            const float v = int8_t(src[j])*scale;
+            if (type == GGML_TYPE_F16) {
+                reinterpret_cast<ggml_fp16_t *>(dst)[i + j] = ggml_fp32_to_fp16(v);
+            } else {
+                reinterpret_cast<float *>(dst)[i + j] = v;
+            }
         }
+        src += gptj_q8_block_size;
     }
+}
 
-    const size_t written  = out - dest;
-    fflush(stdout);
-    return written;
+static std::vector<uint32_t> gptj_state_header(const gptj_kv_cache &kv_self, const std::mt19937 &rng, bool quantize = false)
+{
+    auto header = gpt_rng_save(rng);
+    header.insert(header.begin(), header.size());
+    header.push_back(quantize ? gptj_state_kv_q8 : uint32_t(kv_self.k->type));
+    header.push_back(kv_self.n);
+    return header;
 }
 
-size_t gptj_set_state_data(gptj_model *model, std::mt19937 *rng, const uint8_t *src)
+// calls fn(data, size) for every contiguous part of the kv cache holding tokens begin to kv_self.n
+template<typename Fn>
+static void gptj_state_chunks(const gptj_hparams &hparams, const gptj_kv_cache &kv_self, Fn &&fn, int begin = 0)
 {
-    const uint8_t * in = src;
+    const int n_embd  = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
+    const int n_ctx   = kv_self.n_ctx;
+    // keys and values of each layer are stored token by token
+    const size_t row_size = gptj_kv_row_size(kv_self.k, n_embd);
+    for (int il = 0; il < n_layer; il++) {
+        for (auto t : {kv_self.k, kv_self.v}) {
+            fn(reinterpret_cast<uint8_t*>(t->data) + (size_t(il)*n_ctx + begin)*row_size, (kv_self.n - begin)*row_size);
+        }
+    }
+}
 
-    // set rng
-    {
-        size_t rng_size;
-        char   rng_buf[GPTJ_MAX_RNG_STATE];
+template<typename Write>
+static bool gptj_write_state(const gptj_hparams &hparams, const gptj_kv_cache &kv_self, const std::mt19937 &rng, Write &&write, bool quantize = false, int begin = 0)
+{
+    quantize = quantize && gptj_state_quantizable(kv_self);
+    const auto header = gptj_state_header(kv_self, rng, quantize);
+    if (!write(header.data(), header.size()*sizeof(uint32_t))) {
+        return false;
+    }
 
-        memcpy(&rng_size,   in, sizeof(rng_size));    in += sizeof(rng_size);
-        memcpy(&rng_buf[0], in, GPTJ_MAX_RNG_STATE); in += GPTJ_MAX_RNG_STATE;
+    bool ok = true;
+    std::vector<uint8_t> q8;
+    gptj_state_chunks(hparams, kv_self, [&] (uint8_t *data, size_t size) {
+        if (quantize) {
+            const size_t n = size/ggml_type_size(kv_self.k->type);
+            q8.resize(gptj_q8_size(n));
+            gptj_quantize_q8(kv_self.k->type, data, n, q8.data());
+            ok = ok && write(q8.data(), q8.size());
+        } else {
+            ok = ok && write(data, size);
+        }
+    }, begin);
+    return ok;
+}
 
-        std::stringstream rng_ss;
-        rng_ss.str(std::string(&rng_buf[0], rng_size));
-        rng_ss >> *rng;
+template<typename Read>
+static bool gptj_read_state(const gptj_hparams &hparams, gptj_kv_cache &kv_self, std::mt19937 &rng, Read &&read, int begin = 0)
+{
+    uint32_t rng_size;
+    if (!read(&rng_size, sizeof(rng_size)) || rng_size > std::mt19937::state_size + 1) {
+        return false;
+    }
+    std::vector<uint32_t> rng_state(rng_size);
+    uint32_t kv_type, kv_ntok;
+    if (!read(rng_state.data(), rng_size*sizeof(uint32_t)) || !read(&kv_type, sizeof(kv_type)) || !read(&kv_ntok, sizeof(kv_ntok))) {
+        return false;
+    }
 
-        assert(rng_ss.fail() == false);
+    const bool quantized = kv_type == gptj_state_kv_q8 && gptj_state_quantizable(kv_self);
+    if (kv_type != uint32_t(kv_self.k->type) && !quantized) {
+        fprintf(stderr, "%s: kv cache type of state differs\n", __func__);
+        return false;
+    }
+    if (!gpt_rng_load(rng, rng_state)) {
+        fprintf(stderr, "%s: invalid rng state\n", __func__);
+        return false;
     }
 
-    // set kv cache
-    {
-        size_t kv_size;
-        int kv_ntok;
+    // tokens before begin are kept
+    if (begin > kv_self.n || int(kv_ntok) < begin) {
+        fprintf(stderr, "%s: state delta does not match kv cache\n", __func__);
+        return false;
+    }
+    kv_self.n = begin;
+    kv_self.n_saved = std::min(kv_self.n_saved, begin);
 
-        memcpy(&kv_size, in, sizeof(kv_size)); in += sizeof(kv_size);
-        memcpy(&kv_ntok, in, sizeof(kv_ntok)); in += sizeof(kv_ntok);
+    // make room for the tokens, the cache may have been larger when the state was copied
+    if (int(kv_ntok) > kv_self.n_ctx && !gptj_kv_cache_resize(hparams, kv_self, kv_ntok)) {
+        return false;
+    }
+    kv_self.n = kv_ntok;
+
+    bool ok = true;
+    std::vector<uint8_t> q8;
+    gptj_state_chunks(hparams, kv_self, [&] (uint8_t *data, size_t size) {
+        if (quantized) {
+            const size_t n = size/ggml_type_size(kv_self.k->type);
+            q8.resize(gptj_q8_size(n));
+            ok = ok && read(q8.data(), q8.size());
+            if (ok) gptj_dequantize_q8(kv_self.k->type, q8.data(), n, data);
+        } else {
+            ok = ok && read(data, size);
+        }
+    }, begin);
+    return ok;
+}
 
-        if (kv_size) {
-            assert(model->kv_self.buf.size == kv_size);
+size_t gptj_get_state_size(const gptj_hparams &hparams, const gptj_kv_cache &kv_self, const std::mt19937 &rng)
+{
+    size_t size = gptj_state_header(kv_self, rng).size()*sizeof(uint32_t);
+    gptj_state_chunks(hparams, kv_self, [&] (uint8_t *, size_t chunk_size) {
+        size += chunk_size;
+    });
+    return size;
+}
 
-            void * k_data = model->kv_self.k->data; // remember data pointers
-            void * v_data = model->kv_self.v->data; // because their value is stored in buf and overwritten by memcpy
+size_t gptj_copy_state_data(const gptj_hparams &hparams, const gptj_kv_cache &kv_self, const std::mt19937 &rng, uint8_t *dest)
+{
+    uint8_t * out = dest;
+    gptj_write_state(hparams, kv_self, rng, [&] (const void *data, size_t size) {
+        memcpy(out, data, size); out += size;
+        return true;
+    });
+    return out - dest;
+}
 
-            memcpy(model->kv_self.buf.addr, in, kv_size); in += kv_size;
+size_t gptj_set_state_data(const gptj_hparams &hparams, gptj_kv_cache *kv_self, std::mt19937 *rng, const uint8_t *src)
+{
+    const uint8_t * in = src;
+    const bool ok = gptj_read_state(hparams, *kv_self, *rng, [&] (void *data, size_t size) {
+        memcpy(data, in, size); in += size;
+        return true;
+    });
+    return ok ? in - src : 0;
+}
 
-            model->kv_self.k->data = k_data; // restore correct data pointers
-            model->kv_self.v->data = v_data;
+bool gptj_write_state_data(const gptj_hparams &hparams, const gptj_kv_cache &kv_self, const std::mt19937 &rng, std::ostream &out, bool quantize)
+{
+    return gptj_write_state(hparams, kv_self, rng, [&] (const void *data, size_t size) {
+        return bool(out.write(reinterpret_cast<const char *>(data), size));
+    }, quantize);
+}
 
-        }
+bool gptj_read_state_data(const gptj_hparams &hparams, gptj_kv_cache *kv_self, std::mt19937 *rng, std::istream &in)
+{
+    return gptj_read_state(hparams, *kv_self, *rng, [&] (void *data, size_t size) {
+        return bool(in.read(reinterpret_cast<char *>(data), size));
+    });
+}
 
-        model->kv_self.n = kv_ntok;
+bool gptj_write_state_delta(const gptj_hparams &hparams, gptj_kv_cache &kv_self, const std::mt19937 &rng, std::ostream &out, bool quantize, bool full)
+{
+    const uint32_t begin = full ? 0 : std::min(kv_self.n_saved, kv_self.n);
+    if (!out.write(reinterpret_cast<const char *>(&begin), sizeof(begin))) {
+        return false;
+    }
+    const bool ok = gptj_write_state(hparams, kv_self, rng, [&] (const void *data, size_t size) {
+        return bool(out.write(reinterpret_cast<const char *>(data), size));
+    }, quantize, begin);
+    if (ok) {
+        kv_self.n_saved = kv_self.n;
     }
+    return ok;
+}
 
-    const size_t nread = in - src;
-    fflush(stdout);
-    return nread;
+bool gptj_read_state_delta(const gptj_hparams &hparams, gptj_kv_cache *kv_self, std::mt19937 *rng, std::istream &in)
+{
+    uint32_t begin;
+    if (!in.read(reinterpret_cast<char *>(&begin), sizeof(begin))) {
+        return false;
+    }
+    const bool ok = gptj_read_state(hparams, *kv_self, *rng, [&] (void *data, size_t size) {
+        return bool(in.read(reinterpret_cast<char *>(data), size));
+    }, begin);
+    if (ok) {
+        kv_self->n_saved = kv_self->n;
+    }
+    return ok;
 }
@@ -3,6 +3,7 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
 #include <ggml.h>
 
 #include "../g4a_common.hpp"
@@ -63,6 +64,9 @@ struct gptj_kv_cache {
     gptj_buffer buf;
 
     int n; // number of tokens currently in the cache
+    int n_ctx = 0; // number of tokens there is room for
+    int n_ctx_max = 0; // number of tokens the cache may grow to during evaluation
+    int n_saved = 0; // number of leading tokens unchanged since the state was last written or read by gptj_write_state_delta()/gptj_read_state_delta()
 
     ~gptj_kv_cache() {
         if (ctx) {
@@ -85,14 +89,13 @@ struct gptj_model {
 
     std::vector<gptj_layer> layers;
 
-    // key + value memory
-    struct gptj_kv_cache kv_self;
-
     //
     struct ggml_context * ctx;
     std::map<std::string, struct ggml_tensor *> tensors;
 
-    gptj_buffer buf;
+    // only set if the model file is mapped, tensors then point into it
+    std::unique_ptr<gpt_mmap> mapping;
+    std::vector<std::vector<uint8_t>> unaligned_data;
 
     ~gptj_model() {
         if (ctx) {
@@ -102,10 +105,21 @@ struct gptj_model {
 };
 
 
-bool gptj_model_load(const std::string &fname, std::istream &fin, gptj_model & model, gpt_vocab & vocab);
-bool gptj_model_load(const std::string & fname, gptj_model & model, gpt_vocab & vocab);
-bool gptj_eval(gptj_model& model, const int n_threads, const int n_past, const std::vector<gpt_vocab::id>& embd_inp, std::vector<float>& embd_w, size_t& mem_per_token);
-size_t gptj_get_state_size(const gptj_model &model);
-size_t gptj_copy_state_data(const gptj_model &model, const std::mt19937 &rng, uint8_t *dest);
-size_t gptj_set_state_data(gptj_model *model, std::mt19937 *rng, const uint8_t *src);
+bool gptj_model_load(const std::string &fname, std::istream &fin, gptj_model & model, gpt_vocab & vocab, bool use_mmap = false, bool use_mlock = false);
+bool gptj_model_load(const std::string & fname, gptj_model & model, gpt_vocab & vocab, bool use_mmap = false, bool use_mlock = false);
+bool gptj_kv_cache_init(const gptj_hparams & hparams, gptj_kv_cache & cache, ggml_type wtype, int n_ctx, int n_ctx_max = 0);
+bool gptj_kv_cache_copy(const gptj_hparams & hparams, const gptj_kv_cache & src, gptj_kv_cache & cache, int n_ctx);
+bool gptj_kv_cache_resize(const gptj_hparams & hparams, gptj_kv_cache & cache, int n_ctx);
+void gptj_kv_cache_erase(const gptj_hparams & hparams, gptj_kv_cache & cache, int p0, int p1);
+bool gptj_eval(const gptj_model& model, gptj_kv_cache& kv_self, gptj_buffer& buf, const int n_threads, const int n_past, const std::vector<gpt_vocab::id>& embd_inp, std::vector<float>& embd_w, size_t& mem_per_token, bool all_logits = false);
+size_t gptj_get_state_size(const gptj_hparams &hparams, const gptj_kv_cache &kv_self, const std::mt19937 &rng);
+size_t gptj_copy_state_data(const gptj_hparams &hparams, const gptj_kv_cache &kv_self, const std::mt19937 &rng, uint8_t *dest);
+size_t gptj_set_state_data(const gptj_hparams &hparams, gptj_kv_cache *kv_self, std::mt19937 *rng, const uint8_t *src);
+// quantize stores an F32 or F16 kv cache at 8 bits per element, gptj_read_state_data() converts it back
+bool gptj_write_state_data(const gptj_hparams &hparams, const gptj_kv_cache &kv_self, const std::mt19937 &rng, std::ostream &out, bool quantize = false);
+// Writes only tokens changed since the last delta (or all of them if full is set) along with the rng state
+// Reading the deltas in order restores the state, starting from an empty kv cache or one holding the state of the first one
+bool gptj_write_state_delta(const gptj_hparams &hparams, gptj_kv_cache &kv_self, const std::mt19937 &rng, std::ostream &out, bool quantize, bool full);
+bool gptj_read_state_delta(const gptj_hparams &hparams, gptj_kv_cache *kv_self, std::mt19937 *rng, std::istream &in);
+bool gptj_read_state_data(const gptj_hparams &hparams, gptj_kv_cache *kv_self, std::mt19937 *rng, std::istream &in);
 #endif // GPTJ_HPP
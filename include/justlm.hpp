@@ -6,6 +6,8 @@
 #include <functional>
 #include <memory>
 #include <thread>
+#include <atomic>
+#include <algorithm>
 
 #ifdef LM_NOEXCEPT
 #   define LM_NOEXCEPTDECL noexcept
@@ -43,13 +45,140 @@ using ssize_t = SSIZE_T;
 
 using GenerateCallback = std::function<bool (const char *generated)>;
 using AppendCallback = std::function<bool (float progress)>;
+using SequenceGenerateCallback = std::function<bool (size_t sequence, const char *generated)>;
+
+// Generation started by Inference::generate(), advanced one token per step() so it can be driven from an event loop or worker pool
+class Generation {
+    std::atomic_bool cancelled = false;
+
+public:
+    virtual ~Generation() {}
+
+    // Generates the next token, returns false once generation is done (or failed, see Inference::get_last_error())
+    // on_tick and pre_tick behave like they do in Inference::run()
+    virtual bool step(const GenerateCallback& on_tick = nullptr, const GenerateCallback& pre_tick = nullptr) LM_NOEXCEPTDECL = 0;
+
+    // Text generated so far, in its final form once done
+    virtual const std::string& get_result() const noexcept = 0;
+    virtual bool is_done() const noexcept = 0;
+
+    // May be called from any thread, generation ends before the next token
+    void cancel() noexcept {
+        cancelled = true;
+    }
+    bool is_cancelled() const noexcept {
+        return cancelled;
+    }
+};
 
 class Inference {
 protected:
     AppendCallback on_scroll = nullptr;
 
+    std::shared_ptr<Inference> draft; // See set_draft()
+    unsigned n_draft = 0;
+
     void *generic_state = nullptr;
 
+    size_t n_modifications = 0; // See get_modification_count()
+
+    // Prompt size after given amount of tokens, recorded whenever text is added to the prompt so rewind() can cut it where it was added
+    // Ordered by amount of tokens. Text of tokens in between is assumed to be their pieces, which holds for generated ones
+    std::vector<std::pair<size_t, size_t>> prompt_marks;
+
+    // Must be called whenever the state that gets serialized changes
+    void mark_modified() noexcept {
+        n_modifications++;
+    }
+
+    // Drops the state held by this class, for reset()
+    void reset_base() noexcept {
+        on_scroll = nullptr;
+        draft = nullptr;
+        n_draft = 0;
+        prompt_marks.clear();
+        mark_modified();
+    }
+
+    // Forgets prompt sizes recorded past given amount of tokens, for when tokens are dropped from the end
+    void drop_prompt_marks(size_t n_tokens) noexcept {
+        while (!prompt_marks.empty() && prompt_marks.back().first > n_tokens) prompt_marks.pop_back();
+    }
+    // Records prompt size after given amount of tokens
+    void mark_prompt_size(size_t n_tokens, size_t prompt_size) {
+        drop_prompt_marks(n_tokens);
+        if (!prompt_marks.empty() && prompt_marks.back().first == n_tokens) prompt_marks.pop_back();
+        prompt_marks.emplace_back(n_tokens, prompt_size);
+    }
+    // Moves recorded prompt sizes along with tokens after given range being cut out of the context, for window scrolling
+    void cut_prompt_marks(size_t begin, size_t end) {
+        std::vector<std::pair<size_t, size_t>> kept;
+        for (const auto& [n_tokens, prompt_size] : prompt_marks) {
+            if (n_tokens <= begin) kept.emplace_back(n_tokens, prompt_size);
+            else if (n_tokens >= end) kept.emplace_back(n_tokens-(end-begin), prompt_size);
+        }
+        prompt_marks = std::move(kept);
+    }
+    // Returns prompt size after the first n_tokens of given tokens, using recorded prompt sizes and token_size to get the size of tokens in between
+    template<typename TokenSize>
+    size_t get_prompt_size(size_t n_tokens, const std::vector<int>& tokens, size_t prompt_size, const TokenSize& token_size) const {
+        if (n_tokens == 0) return 0;
+        // Find closest recorded sizes around given amount of tokens, end of the prompt being the last one
+        std::pair<size_t, size_t> upper{tokens.size(), prompt_size};
+        const std::pair<size_t, size_t> *lower = nullptr;
+        for (const auto& mark : prompt_marks) {
+            if (mark.first == n_tokens) return std::min(mark.second, prompt_size);
+            if (mark.first < n_tokens) lower = &mark;
+            else {
+                upper = mark;
+                break;
+            }
+        }
+        upper.second = std::min(upper.second, prompt_size);
+        // Count from lower recorded size if there is one, backwards from upper one otherwise
+        size_t n_chars = 0;
+        if (lower) {
+            for (size_t it = lower->first; it != n_tokens; it++) n_chars += token_size(tokens[it]);
+            return std::min(lower->second+n_chars, upper.second);
+        }
+        for (size_t it = n_tokens; it < std::min(upper.first, tokens.size()); it++) n_chars += token_size(tokens[it]);
+        return upper.second-std::min(n_chars, upper.second);
+    }
+
+    // Maximum amount of tokens get_drafted_tokens() may propose at once
+    unsigned get_max_drafted_tokens() const noexcept {
+        if (draft) return n_draft;
+        if (params.n_lookup_ngram) return params.n_lookup_draft;
+        return 0;
+    }
+
+    // Proposes the tokens that followed the last occurrence of the last n_ngram tokens earlier in given ones
+    static std::vector<int> lookup_tokens(const std::vector<int>& tokens, unsigned n_ngram, unsigned n_max) {
+        if (n_ngram == 0 || n_max == 0 || tokens.size() <= n_ngram) return {};
+        const auto ngram = tokens.end()-n_ngram;
+        for (size_t pos = tokens.size()-n_ngram; pos-- != 0;) {
+            if (std::equal(ngram, tokens.end(), tokens.begin()+pos)) {
+                const auto continuation = tokens.begin()+pos+n_ngram;
+                return std::vector<int>(continuation, continuation+std::min<size_t>(n_max, tokens.end()-continuation));
+            }
+        }
+        return {};
+    }
+
+    // Lets the draft model (or prompt lookup if there is none) propose up to n_max tokens following given ones, dropping any outside of given vocabulary
+    std::vector<int> get_drafted_tokens(const std::vector<int>& tokens, unsigned n_max, unsigned n_vocab) LM_NOEXCEPTDECL {
+        n_max = std::min(n_max, get_max_drafted_tokens());
+        if (n_max == 0) return {};
+        auto fres = draft?draft->predict_tokens(tokens, n_max):lookup_tokens(tokens, params.n_lookup_ngram, n_max);
+        for (size_t it = 0; it != fres.size(); it++) {
+            if (unsigned(fres[it]) >= n_vocab) {
+                fres.resize(it);
+                break;
+            }
+        }
+        return fres;
+    }
+
     LM_LAST_ERROR_STORAGE
 
 public:
@@ -61,6 +190,7 @@ public:
         int seed = 0; // RNG seed
         unsigned n_threads = 0; // Amount of threads to use, immutable after Inference was constructed
         unsigned n_ctx = 2024; // Context size
+        unsigned n_ctx_initial = 0; // Amount of tokens to allocate KV cache for initially, it grows on demand up to context size; 0 for the backend's default, which is 256 for GPT-J and MPT and all of it for LLaMA. LLaMA contexts need to evaluate all tokens again and get reseeded when growing, and don't grow if n_seq_max > 1
         unsigned n_ctx_window_top_bar = 0; // Top bar of context window. Must be smaller than context size
         unsigned n_batch = 8; // Batch size
         unsigned n_repeat_last = 0;
@@ -75,15 +205,29 @@ public:
         float mirostat_target_entropy = 5.0f; // mirostat specific
         float repeat_penalty = 1.0f;
 
+        unsigned n_lookup_ngram = 0; // Length of n-gram to look up in context to draft tokens from what followed it (see set_draft()), 0 to disable; unused if there is a draft model
+        unsigned n_lookup_draft = 10; // Maximum amount of tokens to draft by n-gram lookup
+
         unsigned n_gpu_layers = 38;
-        bool use_mlock = true; // llama specific
+        unsigned n_seq_max = 1; // Maximum amount of sequences sharing one context (see create_sequence()), context is allocated n_seq_max times; llama specific
+        unsigned n_kv_bits = 32; // Bits per KV cache element: 32 (float), 16 (half) or 8 (quantized); lower values save memory at a slight loss of quality; gptj specific
+        bool quantize_serialized_kv = false; // Store KV cache at 8 bits per element when serializing, which makes it about 2-4 times smaller at a slight loss of quality; gptj and mpt specific
+        bool use_mmap = true; // Map weights file into memory instead of reading it, so its pages are shared between processes
+        bool use_mlock = true; // Lock weights in memory; GPT-J and MPT only support this with use_mmap
         int prefer_mirostat = 0; // Use given mirostat version if available (see is_mirostat_available()); llama specific
+
+        // Returns true if an instance constructed with these params may take over given ones after reset(), as they only differ in params that may change later
+        bool is_compatible(const Params& o) const noexcept {
+            return n_threads == o.n_threads && n_ctx == o.n_ctx && n_ctx_initial == o.n_ctx_initial && n_gpu_layers == o.n_gpu_layers
+                && n_seq_max == o.n_seq_max && n_kv_bits == o.n_kv_bits && use_mmap == o.use_mmap && use_mlock == o.use_mlock;
+        }
     } params;
 
     struct Savestate {
         std::vector<uint8_t> buf;
         std::vector<int> tokens;
         std::string prompt;
+        std::vector<std::pair<size_t, size_t>> prompt_marks;
         void *ctx = nullptr;
 
         bool is_valid() const {
@@ -112,20 +256,61 @@ public:
         on_scroll = scroll_cb;
     }
 
+    // Enables speculative decoding: run() lets given smaller model propose n_draft_tokens tokens ahead and verifies them in a single batch
+    // The draft model must use the same vocabulary and a context at least as big as this ones; output is the same as without it
+    // Pass nullptr to disable speculative decoding again
+    void set_draft(const std::shared_ptr<Inference>& draft_model, unsigned n_draft_tokens = 5) noexcept {
+        draft = draft_model;
+        n_draft = n_draft_tokens;
+    }
+
     // This must be called with a non-empty prompt!
     virtual LM_ERRBOOL append(const std::string& prompt, const AppendCallback& on_tick = nullptr) LM_NOEXCEPTDECL = 0;
 
+    // Replaces the whole prompt, keeping the part of the context that both have in common instead of evaluating it again
+    // Meant for callers that resend the whole conversation each time
+    virtual LM_ERRBOOL set_prompt(const std::string& prompt, const AppendCallback& on_tick = nullptr) LM_NOEXCEPTDECL = 0;
+
+    // Drops everything after the first n_tokens tokens of the context (see get_context_size()) from it and the prompt
+    // Lets callers regenerate or edit recent messages without a savestate, the KV cache of kept tokens is kept as is
+    virtual LM_ERRBOOL rewind(unsigned n_tokens) LM_NOEXCEPTDECL = 0;
+
+    // append() must have been called at least once before calling this!
+    // Starts generating like run() does, but without blocking (see Generation)
+    // The inference must not be used otherwise until the returned generation is done or destroyed, which it must be before the inference is
+    virtual std::unique_ptr<Generation> generate(std::string_view end = "") LM_NOEXCEPTDECL = 0;
+
     // append() must have been called at least once before calling this!
     virtual std::string run(std::string_view end = "", const GenerateCallback& on_tick = nullptr, const GenerateCallback& pre_tick = nullptr) LM_NOEXCEPTDECL = 0;
 
     virtual unsigned get_context_size() const noexcept = 0;
+    // Changes whenever the state that gets serialized (besides params) changes, so callers can tell if it needs to be written again
+    size_t get_modification_count() const noexcept {
+        return n_modifications;
+    }
+    // Approximate amount of memory used by the session of this instance (KV cache, logits, tokens), in bytes
+    // Memory every instance needs regardless of the session, like weights and scratch buffers, isn't included
+    virtual size_t get_memory_usage() const noexcept = 0;
 
     virtual LM_ERRBOOL create_savestate(Savestate&) const LM_NOEXCEPTDECL = 0;
     virtual LM_ERRBOOL restore_savestate(const Savestate&) LM_NOEXCEPTDECL = 0;
 
+    // Brings instance back into the state it was in after construction, reseeding RNG from params, but keeping model and allocated context
+    // Lets instances be recycled for other sessions using the same weights and compatible params (see Params::is_compatible())
+    virtual LM_ERRBOOL reset() LM_NOEXCEPTDECL = 0;
+
     virtual LM_ERRBOOL serialize(std::ostream&) const LM_NOEXCEPTDECL = 0;
     virtual LM_ERRBOOL deserialize(std::istream&) LM_NOEXCEPTDECL = 0;
 
+    // Writes only what changed since the last delta was written or read, or everything if full is set
+    // Reading all deltas since the last full one in order with deserialize_delta() restores the state on a new instance
+    virtual LM_ERRBOOL serialize_delta(std::ostream&, bool full [[maybe_unused]]) LM_NOEXCEPTDECL {
+        LM_THROW("Delta serialization is not available for this models backend", LM_BOOL_ERROR);
+    }
+    virtual LM_ERRBOOL deserialize_delta(std::istream&) LM_NOEXCEPTDECL {
+        LM_THROW("Delta serialization is not available for this models backend", LM_BOOL_ERROR);
+    }
+
     virtual LM_ERRBOOL load_grammar(const std::string&, bool override_temperature [[maybe_unused]] = false) LM_NOEXCEPTDECL {
         LM_THROW("Grammar is not available for this models backend", LM_BOOL_ERROR);
     }
@@ -133,10 +318,50 @@ public:
         LM_THROW("Grammar is not available for this models backend", LM_BOOL_ERROR);
     }
 
+    // Creates another sequence inside the same context (see Params::n_seq_max), sharing model and context memory
+    // The returned instance behaves like an independent Inference with its own prompt and params
+    virtual Inference *create_sequence(const Params&) LM_NOEXCEPTDECL {
+        LM_THROW("Multiple sequences are not available for this models backend", nullptr);
+    }
+    // Creates a branch that continues independently from the current state, sharing weights and the evaluated part of the KV cache
+    // Branches sample independently. Only available for LLaMA, use savestates for other backends
+    virtual Inference *fork() LM_NOEXCEPTDECL {
+        LM_THROW("Forking is not available for this models backend", nullptr);
+    }
+    // Runs this and/or other sequences of the same context in lockstep, evaluating one token of each in a single batch
+    // append() must have been called at least once on every given sequence before calling this!
+    virtual std::vector<std::string> run_sequences(const std::vector<Inference*>&, std::string_view end [[maybe_unused]] = "", const SequenceGenerateCallback& on_tick [[maybe_unused]] = nullptr) LM_NOEXCEPTDECL {
+        LM_THROW("Multiple sequences are not available for this models backend", {});
+    }
+
+    // append() must have been called at least once before calling this!
+    // Generates n completions like run() does, evaluating the context only once and the completions in lockstep; the context continues with the first one
+    // Needs n-1 free sequences in the context (see Params::n_seq_max), each completion draws its own samples
+    virtual std::vector<std::string> run_n(unsigned n [[maybe_unused]], std::string_view end [[maybe_unused]] = "", const SequenceGenerateCallback& on_tick [[maybe_unused]] = nullptr) LM_NOEXCEPTDECL {
+        LM_THROW("Multiple sequences are not available for this models backend", {});
+    }
+
+    // append() must have been called at least once before calling this!
+    // Generates like run() does, but follows the n_beams most likely continuations at each step instead of sampling one, ignoring sampling params
+    // Returns up to n_beams finished continuations, best first, and continues the context with the best one
+    // They are ranked by log likelihood divided by length in tokens to the power of length_penalty, so higher values favor longer ones
+    // With early_stopping, search ends once n_beams continuations have finished, otherwise once unfinished ones can't rank better anymore
+    virtual std::vector<std::string> run_beam_search(unsigned n_beams [[maybe_unused]], std::string_view end [[maybe_unused]] = "", float length_penalty [[maybe_unused]] = 1.0f, bool early_stopping [[maybe_unused]] = true) LM_NOEXCEPTDECL {
+        LM_THROW("Beam search is not available for this models backend", {});
+    }
+
+    // Replaces the context with given tokens and greedily predicts up to n tokens following them, without keeping those
+    // Used on draft models (see set_draft()), the prompt is not kept up to date
+    virtual std::vector<int> predict_tokens(const std::vector<int>&, unsigned n [[maybe_unused]]) LM_NOEXCEPTDECL {
+        LM_THROW("Drafting tokens is not available for this models backend", {});
+    }
+
     virtual const std::string& get_prompt() const LM_NOEXCEPTDECL = 0;
 
     virtual bool is_mirostat_available() const noexcept {return false;}
     virtual bool is_grammar_available() const noexcept {return false;}
+    virtual bool is_multi_sequence_available() const noexcept {return false;}
+    virtual bool is_delta_serialization_available() const noexcept {return false;}
 
     LM_LAST_ERROR_GETTER
 };
@@ -5,20 +5,90 @@
 #include <string>
 #include <string_view>
 #include <vector>
+#include <deque>
 #include <chrono>
 #include <memory>
 #include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <array>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
 
 
 namespace LM {
+// Decides which instance an InferencePool evicts first once it is full
+class EvictionPolicy {
+public:
+    struct SlotStats {
+        size_t id = 0;
+        size_t memory_usage = 0; // Bytes used by instance as of when it was last loaded or released (see Inference::get_memory_usage())
+        std::chrono::system_clock::time_point last_access;
+        size_t n_accesses = 0; // Kept across evictions
+        std::chrono::milliseconds load_time{0}; // Time it took to create or load the instance the last time
+    };
+
+    virtual ~EvictionPolicy() {}
+
+    // Returns true if a should be evicted before b
+    virtual bool evict_before(const SlotStats& a, const SlotStats& b) const = 0;
+};
+
+// Evicts least recently used instance first
+class LRUEvictionPolicy : public EvictionPolicy {
+public:
+    bool evict_before(const SlotStats& a, const SlotStats& b) const override {
+        return a.last_access < b.last_access;
+    }
+};
+
+// Evicts least frequently used instance first, least recently used one if equally frequent
+class LFUEvictionPolicy : public EvictionPolicy {
+public:
+    bool evict_before(const SlotStats& a, const SlotStats& b) const override {
+        if (a.n_accesses != b.n_accesses) return a.n_accesses < b.n_accesses;
+        return a.last_access < b.last_access;
+    }
+};
+
+// Evicts instance that is cheapest to get back per byte it frees first, cost being load time times access frequency
+class CostAwareEvictionPolicy : public EvictionPolicy {
+    static double get_value(const SlotStats& s) {
+        const auto load_time = std::max<double>(s.load_time.count(), 1.0);
+        return load_time * double(s.n_accesses) / double(std::max<size_t>(s.memory_usage, 1));
+    }
+
+public:
+    bool evict_before(const SlotStats& a, const SlotStats& b) const override {
+        const auto va = get_value(a), vb = get_value(b);
+        if (va != vb) return va < vb;
+        return a.last_access < b.last_access;
+    }
+};
+
 class InferencePool {
+    enum class SlotState {
+        free, // Holds no instance
+        live, // Holds an instance that is ready for use
+        evicted, // Holds an instance that is queued for being written to disk, may still be taken back
+        writing, // Holds an instance that is being written to disk, slot is freed afterwards unless the instance is wanted again
+        loading // Instance is being created or loaded from disk
+    };
+
     class Slot {
         std::shared_ptr<Inference> inference;
         size_t id;
-        std::chrono::system_clock::time_point last_access;
         std::string weights_path;
+        SlotState state;
 
     public:
+        bool wanted; // Set while someone waits for the instance that is being written to disk
+        bool leased; // Set while a Lease on the slot exists, slot can't be evicted meanwhile
+        size_t n_holders; // Amount of instance pointers handed out without a lease that are still referenced (see get_held_inference()), slot can't be evicted meanwhile either
+
         Slot() {
             reset();
         }
@@ -26,35 +96,94 @@ class InferencePool {
         void reset() {
             inference = nullptr;
             id = 0;
+            state = SlotState::free;
+            wanted = false;
+            leased = false;
+            n_holders = 0;
         }
         bool is_free() const {
-            return inference == nullptr;
+            return state == SlotState::free;
         }
-        std::shared_ptr<Inference> create_inference(size_t id, const std::string& weights_path, const Inference::Params& p) {
-            this->id = id;
+        bool is_in_use() const {
+            return leased || n_holders != 0;
+        }
+        // Leases or holds slot for the caller
+        void acquire(bool lease) {
+            if (lease) leased = true;
+            else n_holders++;
+        }
+        std::shared_ptr<Inference> create_inference(const std::string& weights_path, const Inference::Params& p) {
             this->weights_path = weights_path;
             inference.reset(Inference::construct(weights_path, p));
-            return get_inference(true);
+            return get_inference();
+        }
+        void set_inference(const std::string& weights_path, const std::shared_ptr<Inference>& inference) {
+            this->weights_path = weights_path;
+            this->inference = inference;
         }
-        std::shared_ptr<Inference> get_inference(bool update_last_access = false) {
-            if (update_last_access) last_access = std::chrono::system_clock::now();
+        std::shared_ptr<Inference> get_inference() {
             return inference;
         }
 
         auto get_id() const {
             return id;
         }
-        auto get_last_access() const {
-            return last_access;
-        }
         std::string_view get_weights_path() const {
             return weights_path;
         }
+        SlotState get_state() const {
+            return state;
+        }
+        void set_state(SlotState s) {
+            state = s;
+        }
+        void set_id(size_t id) {
+            this->id = id;
+        }
+    };
+    // There are more slots than instances may be live, extra ones hold evicted instances until they have been written
+    // More are added as needed for held instances, so slots never move
+    std::deque<Slot> slots;
+    size_t size,
+           max_pending_writes;
+
+    // Non-free slots by ID
+    std::unordered_map<size_t, Slot*> index;
+
+    // Statistics by ID, kept after eviction so instances that are loaded again don't start over
+    std::unordered_map<size_t, EvictionPolicy::SlotStats> stats;
+    std::unordered_set<size_t> pinned;
+    std::unique_ptr<EvictionPolicy> policy = std::make_unique<LRUEvictionPolicy>();
+    size_t memory_budget = 0;
+
+    // Instances of evicted slots, reset and kept so loading another one using the same weights doesn't need to create it from scratch
+    struct Spare {
+        std::string weights_path;
+        std::shared_ptr<Inference> inference;
     };
-    std::vector<Slot> slots;
+    std::deque<Spare> spares; // Most recently evicted last
+    size_t max_spares = 1;
+
+    std::atomic_bool compress_slots = false;
+    bool quantize_slot_kv = false;
+
+    // Guards slots, index, spares, slot files and write queue, slot_cv is notified whenever a slot changes state or is released
+    // It is never held while instances are created, loaded or written
+    std::mutex mutex;
+    std::condition_variable slot_cv;
+
+    // Evicted slots are written to disk by the I/O thread
+    std::deque<Slot*> write_queue;
+    std::condition_variable write_queue_cv;
+    bool stopping = false;
+    std::thread io_thread;
 
     std::string pool_name;
 
+    size_t n_failed_writes = 0;
+    // Expires along with the pool, instance pointers handed out without a lease may outlive it
+    std::shared_ptr<char> alive = std::make_shared<char>();
+
     std::string get_slot_filename_prefix() const {
         return "LMInferencePool_"+pool_name+'_';
     }
@@ -62,46 +191,174 @@ class InferencePool {
         return get_slot_filename_prefix()+std::to_string(id);
     }
 
+    // Slot files start with weights path and params, followed by the serialized instance
+    // For instances that support delta serialization, they instead hold a series of records like that, each one holding a delta
+    // A new file is started once the deltas add up to more than the first record
+    struct SlotFile {
+        size_t size = 0; // Any other file size means the file has been changed by something else
+        size_t base_size = 0,
+               delta_size = 0;
+        bool deltas = false; // If deltas may be appended
+        // Instance as of when the file was written or read, the file is up to date as long as it doesn't change
+        size_t n_modifications = 0;
+        std::array<char, sizeof(Inference::Params)> params;
+    };
+    static constexpr char delta_magic[4] = {'J', 'L', 'M', 'D'};
+    // Files written or read by ID
+    std::unordered_map<size_t, SlotFile> slot_files;
+
+    // Returns true if the file of given slot holds the current state of its instance already
+    bool is_slot_file_current(Slot& slot);
+    // Remembers that the file of given slot holds the current state of its instance
+    void set_slot_file(Slot& slot, SlotFile file);
+
+    static bool write_slot_header(std::ostream& o, Slot& slot);
+    static bool read_slot_header(std::istream& i, std::string& weights_path, Inference::Params& p);
+
+    // Puts a spare instance compatible with given params into given slot, or creates a new one if there is none
+    std::shared_ptr<Inference> recycle_inference(Slot& slot, const std::string& weights_path, const Inference::Params& p);
+
     // Returns false on error
     bool store_slot(Slot& slot);
-    // Returns nullptr on error
-    Slot *load_slot(size_t id, Slot *suggested_slot = nullptr);
+    bool store_slot_delta(Slot& slot);
+    // Loads instance into given slot, returns false on error
+    bool load_slot(size_t id, Slot& slot);
+    bool load_slot_delta(std::istream& f, Slot& slot);
 
-    void store_and_reset_slot(Slot& slot) {
-        store_slot(slot); //TODO: Should handle errors somehow
-        slot.reset();
-        return;
+    void run_io_thread();
+
+    // Returns instance of given held slot, the hold is released once the returned pointer and all copies of it are gone
+    std::shared_ptr<Inference> get_held_inference(Slot& slot);
+    void release_hold(Slot& slot, const std::shared_ptr<Inference>& inference);
+
+    using Deadline = std::optional<std::chrono::steady_clock::time_point>;
+    static Deadline get_deadline(std::optional<std::chrono::milliseconds> timeout) {
+        if (!timeout) return {};
+        return std::chrono::steady_clock::now()+*timeout;
     }
 
-    // Doesn't fail
-    Slot *get_free_slot();
+    // All functions below expect the mutex to be locked
+
+    // Waits for a slot to change, returns false on timeout
+    bool wait(std::unique_lock<std::mutex>& L, const Deadline& deadline);
+
+    // Updates statistics of given live slot, counting an access if requested
+    // Memory usage is only updated if the slot isn't leased or held, since the instance may be in use otherwise
+    void update_stats(Slot& slot, bool count_access);
+
+    // Called once given slot has been written to disk, frees the slot unless the instance has been asked for meanwhile or couldn't be written
+    // Returns the freed instance, if any
+    Spare finish_write(Slot& slot, bool ok);
+    void report_write_error(const Slot& slot);
 
-    // Returns nullptr if not found
-    Slot *find_slot_by_id(size_t id, bool deserialize = true);
+    // Evicts unleased and unpinned live slots other than keep as the policy suggests until keep_free more instances using keep_bytes may be live
+    // Held slots aren't counted against the pool size, so holding instances can't keep others from being loaded
+    // Returns false if not enough slots could be freed, the memory budget is exceeded rather than waiting though
+    bool make_room(std::unique_lock<std::mutex>& L, size_t keep_free = 0, size_t keep_bytes = 0, const Slot *keep = nullptr);
+
+    // Returns a free slot that has been put into loading state
+    // Returns nullptr if there is none yet because of pending writes or leases, the caller should wait for that to change and look for the ID again
+    Slot *reserve_slot(std::unique_lock<std::mutex>& L, size_t id);
+
+    void free_slot(Slot& slot);
+    void release_slot(Slot& slot);
+
+    // Returns live slot holding given ID, waiting for it to be loaded or taking it back from the write queue if needed
+    // If not in memory, instance is loaded from disk if requested. Slot is leased if requested, waiting for other leases to be released, and held otherwise
+    // Returns nullptr if not found or on timeout
+    Slot *find_slot_by_id(std::unique_lock<std::mutex>& L, size_t id, bool deserialize, bool lease = false, const Deadline& deadline = {});
+
+    // Creates instance, replacing existing one with same ID. Slot is leased if requested and held otherwise. Returns nullptr on error or timeout
+    Slot *create_inference(std::unique_lock<std::mutex>& L, size_t id, const std::string& weights_path, const Inference::Params& p, bool lease = false, const Deadline& deadline = {});
 
 public:
-    // The pool_name must be unique amonst all applications in cwd
-    InferencePool(size_t size, const std::string& pool_name, bool clean_up = true)
-            : pool_name(pool_name) {
-        // Make sure size isn't zero
-        if (size == 0) size = 1;
-        // Create slots as requested
-        slots.resize(size);
-        // Clean up previous slots as requested
-        if (clean_up) {
-            cleanup();
+    // Exclusive access to an instance, which can't be evicted while the lease exists
+    // Empty if the instance couldn't be found or created in time
+    class Lease {
+        friend InferencePool;
+
+        InferencePool *pool = nullptr;
+        Slot *slot = nullptr;
+        std::shared_ptr<Inference> inference;
+
+        Lease(InferencePool *pool, Slot *slot) : pool(pool), slot(slot), inference(slot->get_inference()) {}
+
+    public:
+        Lease() {}
+        Lease(const Lease&) = delete;
+        Lease(Lease&& o) {
+            *this = std::move(o);
+        }
+        Lease& operator =(Lease&& o) {
+            release();
+            pool = o.pool;
+            slot = o.slot;
+            inference = std::move(o.inference);
+            o.pool = nullptr;
+            o.slot = nullptr;
+            return *this;
+        }
+        ~Lease() {
+            release();
         }
-    }
 
-    std::shared_ptr<Inference> create_inference(size_t id, const std::string& weights_path, const Inference::Params& p) {
-        auto slot = get_free_slot();
-        return slot->create_inference(id, weights_path, p);
-    }
+        // Gives instance back to pool early
+        void release();
+
+        Inference *get() const {
+            return inference.get();
+        }
+        Inference *operator ->() const {
+            return get();
+        }
+        Inference& operator *() const {
+            return *get();
+        }
+        explicit operator bool() const {
+            return inference != nullptr;
+        }
+    };
+
+    // The pool_name must be unique amonst all applications in cwd
+    // Evicted instances are written to disk in the background, max_pending_writes limits how many of them may be kept in memory meanwhile
+    // All functions are thread safe, but no leases may outlive the pool
+    InferencePool(size_t size, const std::string& pool_name, bool clean_up = true, size_t max_pending_writes = 2);
+    ~InferencePool();
+
+    // Lease instance, loading it from disk if needed. Waits until it is free and room has been made for it, up to timeout if given
+    Lease lease_inference(size_t id, std::optional<std::chrono::milliseconds> timeout = {});
+    Lease lease_or_create_inference(size_t id, const std::string& weights_path, const Inference::Params& p, std::optional<std::chrono::milliseconds> timeout = {});
+
+    // Functions below don't lease the instance, but it isn't evicted while the returned pointer or a copy of it is referenced
+    // Unlike leases, they don't wait for others to be done with the instance, and the pool may hold more instances than its size meanwhile
+    std::shared_ptr<Inference> create_inference(size_t id, const std::string& weights_path, const Inference::Params& p);
     std::shared_ptr<Inference> get_inference(size_t id);
+    // Loads instance in the background, so other work can be done meanwhile
+    std::future<std::shared_ptr<Inference>> get_inference_async(size_t id);
     std::shared_ptr<Inference> get_or_create_inference(size_t id, const std::string& weights_path, const Inference::Params& p);
     void delete_inference(size_t id);
+    // Writes all instances to disk, waiting for background writes to complete and leases to be released
+    // Instances that couldn't be written are kept in memory and reported on stderr
+    // Instances returned by the functions above are written as well, so they must not be in use meanwhile
     void store_all();
-    std::vector<size_t> get_active_slot_ids() const;
+    std::vector<size_t> get_active_slot_ids();
+    // Amount of times an instance couldn't be written to disk
+    size_t get_failed_write_count();
+
+    // Limits memory used by sessions of live instances (see Inference::get_memory_usage()), 0 for no limit
+    // Leased, held and pinned instances may exceed it
+    void set_memory_budget(size_t bytes);
+    // Memory currently used by live instances, as of when they were last loaded or released
+    size_t get_memory_usage();
+    void set_eviction_policy(std::unique_ptr<EvictionPolicy> policy);
+    // Pinned instances are never evicted, so there must be less of them than the pool size
+    void set_pinned(size_t id, bool pinned = true);
+    // Compresses instances written to disk from now on, files written before stay readable
+    // quantize_kv makes instances created from now on store their KV cache at 8 bits (see Inference::Params::quantize_serialized_kv)
+    void set_slot_compression(bool compress, bool quantize_kv = false);
+    // Instances evicted from memory are reset and up to n of them are kept, so loading others using the same weights and compatible params (see Inference::Params::is_compatible()) only has to deserialize them
+    // Spare instances keep their context allocated and aren't counted against the memory budget; 0 destroys evicted instances right away
+    void set_max_spare_instances(size_t n);
 
     void cleanup();
     void cleanup(time_t max_age/*seconds*/);
@@ -5,6 +5,7 @@
 #include <vector>
 #include <fstream>
 #include <filesystem>
+#include <mutex>
 
 
 
@@ -47,6 +48,7 @@ Dlhandle get_implementation(std::ifstream& input_f) {
 
 LM::Inference *LM::Inference::construct(const std::string &weights_path, const Params &p) {
     static std::vector<Dlhandle> dls;
+    static std::mutex dls_mutex;
     // Read magic
     std::ifstream f(weights_path, std::ios::binary);
     if (!f) {
@@ -59,7 +61,10 @@ LM::Inference *LM::Inference::construct(const std::string &weights_path, const P
     auto constructor = impl.get<LM::Inference *(const std::string &, std::ifstream&, const LM::Inference::Params &)>("construct");
     if (!constructor) return nullptr;
     // Back up Dlhandle
-    dls.push_back(std::move(impl));
+    {
+        std::scoped_lock L(dls_mutex);
+        dls.push_back(std::move(impl));
+    }
     // Construct inference
     f.seekg(0);
     return constructor(weights_path, f, p);
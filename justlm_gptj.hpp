@@ -1,7 +1,10 @@
 #include "justlm.hpp"
+#include "model_registry.hpp"
 
 #include <fstream>
+#include <memory>
 #include <random>
+#include <algorithm>
 #include <cstring>
 #include "gptj/gptj.hpp"
 #include "g4a_common.hpp"
@@ -11,16 +14,28 @@ namespace LM {
 class GPTJInference final : public Inference {
     std::string weights_path;
 
-    struct State {
+    // Shared between all instances using the same weights
+    struct Weights {
         gpt_vocab vocab;
         gptj_model model;
+    };
+
+    struct State {
+        std::shared_ptr<Weights> weights;
+        const gpt_vocab& vocab;
+        const gptj_model& model;
+        gptj_kv_cache kv_self;
+        gptj_buffer buf;
         std::string prompt; // Mostly here for easy "debugging"
         std::vector<int> tokens;
+        std::vector<int> saved_tokens; // As of last serialize_delta() or deserialize_delta()
+        std::string saved_prompt;
         std::vector<float> logits;
         size_t mem_per_token = 0;
         std::mt19937 rng;
+        gpt_sampler sampler;
 
-        State(int32_t seed) : rng(seed) {}
+        State(const std::shared_ptr<Weights>& weights, int32_t seed) : weights(weights), vocab(weights->vocab), model(weights->model), rng(seed) {}
     };
 
     State*& get_state() LM_NOEXCEPTDECL {
@@ -34,21 +49,46 @@ class GPTJInference final : public Inference {
         auto& state = get_state();
         weights_path = _weights_path;
 
-        // Allocate state
-        state = new State(params.seed);
-
-        // Load model
-        if (!gptj_model_load(weights_path, f, state->model, state->vocab)) {
+        // Get weights, loading them only if no other instance uses them yet
+        auto weights = ModelRegistry<Weights>::get_instance().get(weights_path, [&] () {
+            auto fres = std::make_shared<Weights>();
+            if (!gptj_model_load(weights_path, f, fres->model, fres->vocab, params.use_mmap, params.use_mlock)) fres = nullptr;
+            return fres;
+        });
+        if (!weights) {
             LM_THROW("Failed to initialize gptj from file", LM_BOOL_ERROR);
         }
 
+        // Allocate state
+        state = new State(weights, params.seed);
+
+        // Allocate KV cache, it grows as needed up to the context size
+        ggml_type kv_type;
+        switch (params.n_kv_bits) {
+        case 32: kv_type = GGML_TYPE_F32; break;
+        case 16: kv_type = GGML_TYPE_F16; break;
+        case 8: kv_type = GGML_TYPE_Q8_0; break;
+        default: LM_THROW("Unsupported KV cache element size (must be 32, 16 or 8 bits)", LM_BOOL_ERROR);
+        }
+        const unsigned n_ctx_model = state->model.hparams.n_ctx;
+        params.n_ctx = params.n_ctx>0?std::min(params.n_ctx, n_ctx_model):n_ctx_model;
+        if (!gptj_kv_cache_init(state->model.hparams, state->kv_self, kv_type, get_initial_context_size(), params.n_ctx)) {
+            LM_THROW("Failed to allocate KV cache", LM_BOOL_ERROR);
+        }
+
         // Calculate memory required per token
         static std::vector<gpt_vocab::id> p_instruct;
         static std::vector<gpt_vocab::id> r_instruct;
-        gptj_eval(state->model, params.n_threads, 0, { 0, 1, 2, 3 }, state->logits, state->mem_per_token);
+        gptj_eval(state->model, state->kv_self, state->buf, params.n_threads, 0, { 0, 1, 2, 3 }, state->logits, state->mem_per_token);
+        state->kv_self.n = 0;
 
         return LM_BOOL_SUCCESS;
     }
+    unsigned get_initial_context_size() const noexcept {
+        // Growing only copies the KV cache, so it starts small unless requested otherwise
+        return std::min(params.n_ctx, params.n_ctx_initial>0?params.n_ctx_initial:256u);
+    }
+
     void deinit() LM_NOEXCEPTDECL {
         auto& state = get_state();
 
@@ -58,7 +98,7 @@ class GPTJInference final : public Inference {
     }
 
     // This function reduces the size of our tokens vector according to some parameters
-    // All tokens will be evaluated if scrolling was needed and true will be returned
+    // All tokens not evaluated yet will be evaluated if scrolling was needed and true will be returned
     bool window_scroll() LM_NOEXCEPTDECL {
         auto &state = get_state();
         // Check that we actually need to scroll
@@ -66,25 +106,31 @@ class GPTJInference final : public Inference {
             // Nope
             return false;
         }
-        // Start scrolling
+        // Get range of tokens to discard
+        const size_t discard_begin = params.n_ctx_window_top_bar;
+        size_t discard_end = state->tokens.size();
         if (params.scroll_keep > 0.0f) {
             // "Scroll" down the context window...
             unsigned keep_count = float(state->tokens.size() - params.n_ctx_window_top_bar) * 0.4f; // We keep about 40%
-            // Get vector of tokens to keep
-            std::vector<int> tokens_in_view(state->tokens.end()-keep_count, state->tokens.end());
-            // Cut down tokens vector size
-            state->tokens.resize(params.n_ctx_window_top_bar+keep_count);
-            // Overwrite tokens after top bar with tokens in view
-            std::memcpy(state->tokens.data()+params.n_ctx_window_top_bar, tokens_in_view.data(), tokens_in_view.size()*sizeof(int));
-        } else {
-            // Cut down tokens vector size to top bar
-            state->tokens.resize(params.n_ctx_window_top_bar);
-        }
-        // Evaluate tokens
-        LM_ERROR_FORWARD(evaluate_tokens(0, on_scroll), LM_BOOL_ERROR);
+            discard_end -= keep_count;
+        }
+        // Cut discarded tokens out of tokens vector and KV cache
+        state->tokens.erase(state->tokens.begin()+discard_begin, state->tokens.begin()+discard_end);
+        gptj_kv_cache_erase(state->model.hparams, state->kv_self, discard_begin, discard_end);
+        cut_prompt_marks(discard_begin, discard_end);
+        // Evaluate tokens that haven't been evaluated yet
+        LM_ERROR_FORWARD(evaluate_tokens(state->kv_self.n, on_scroll), LM_BOOL_ERROR);
         return true;
     }
 
+    // Drops all tokens from given position on, later evaluations overwrite their KV cache entries
+    void truncate(size_t n_tokens) LM_NOEXCEPTDECL {
+        auto& state = get_state();
+        state->tokens.resize(n_tokens);
+        state->kv_self.n = n_tokens;
+        drop_prompt_marks(n_tokens);
+    }
+
     LM_ERRBOOL evaluate_tokens(size_t starting_offset, const AppendCallback &on_tick = nullptr) LM_NOEXCEPTDECL {
         auto& state = get_state();
 
@@ -95,7 +141,7 @@ class GPTJInference final : public Inference {
 
             // Evaluate
             std::vector<int> batch(state->tokens.begin()+it, state->tokens.begin()+it+params.n_batch);
-            if (!gptj_eval(state->model, params.n_threads, it, batch, state->logits, state->mem_per_token)) {
+            if (!gptj_eval(state->model, state->kv_self, state->buf, params.n_threads, it, batch, state->logits, state->mem_per_token)) {
                 LM_THROW("Failed to evaluate tokens in batches", LM_BOOL_ERROR);
             }
 
@@ -113,7 +159,7 @@ class GPTJInference final : public Inference {
             for (; it != state->tokens.size(); it++) {
                 //TODO: This is extremely inefficient! Don't do that...
                 std::vector<int> batch(state->tokens.begin()+it, state->tokens.begin()+it+1);
-                if (!gptj_eval(state->model, params.n_threads, it, batch, state->logits, state->mem_per_token)) {
+                if (!gptj_eval(state->model, state->kv_self, state->buf, params.n_threads, it, batch, state->logits, state->mem_per_token)) {
                     LM_THROW("Failed to evaluate individual tokens", LM_BOOL_ERROR);
                 }
             }
@@ -125,6 +171,140 @@ class GPTJInference final : public Inference {
         return LM_BOOL_SUCCESS;
     }
 
+    struct GPTJGeneration final : public Generation {
+        GPTJInference& inference;
+        std::string end;
+        std::string result;
+        size_t last_size = 0;
+        unsigned eos_count = 0;
+        bool abort = false;
+        bool done = false;
+
+        // Tokens drafted by draft model or prompt lookup that have been evaluated past the end of the context but not accepted yet
+        std::vector<int> drafted;
+        std::vector<float> drafted_logits;
+        size_t n_drafted_accepted = 0;
+
+        GPTJGeneration(GPTJInference& inference, std::string_view end)
+            : inference(inference), end(end) {}
+        ~GPTJGeneration() override {
+            if (!done) inference.finish_generation(*this);
+        }
+
+        bool step(const GenerateCallback& on_tick, const GenerateCallback& pre_tick) LM_NOEXCEPTDECL override {
+            return inference.generation_step(*this, on_tick, pre_tick);
+        }
+
+        const std::string& get_result() const noexcept override {
+            return result;
+        }
+        bool is_done() const noexcept override {
+            return done;
+        }
+    };
+
+    // Ends given generation, returns false for convenience
+    bool finish_generation(GPTJGeneration& g) {
+        auto& state = get_state();
+
+        // Drop drafted tokens that haven't been accepted
+        if (g.n_drafted_accepted != g.drafted.size()) {
+            state->kv_self.n = state->tokens.size();
+            g.drafted.clear();
+            g.n_drafted_accepted = 0;
+        }
+
+        // Create final string
+        if (!g.abort) {
+            g.result.resize(g.last_size);
+        }
+
+        g.done = true;
+        return false;
+    }
+
+    bool generation_step(GPTJGeneration& g, const GenerateCallback &on_tick, const GenerateCallback& pre_tick) LM_NOEXCEPTDECL {
+        auto& state = get_state();
+        mark_modified();
+        const auto n_vocab = state->model.hparams.n_vocab;
+
+        // Check if done
+        if (g.done) return false;
+        if (g.is_cancelled()) {
+            g.abort = true;
+            return finish_generation(g);
+        }
+
+        g.last_size = g.result.size();
+        // Sample top p and top k
+        const auto n_repeat_last = std::min<size_t>(state->tokens.size(), params.n_repeat_last);
+        auto id = state->sampler.sample(state->model.hparams.n_vocab, state->tokens.data()+state->tokens.size()-n_repeat_last, n_repeat_last, state->logits.data(), params.top_k, params.top_p, params.temp, params.repeat_penalty, state->rng);
+
+        if (id == 50256) {
+            if (g.eos_count++ == params.n_eos_ignores) {
+                g.abort = true;
+                return finish_generation(g);
+            }
+            id = gpt_tokenize(state->vocab, "\n")[0];
+        }
+
+        // Add token
+        state->tokens.push_back(id);
+
+        // Check if token has been drafted and therefore evaluated already
+        bool evaluated = false;
+        if (g.n_drafted_accepted != g.drafted.size()) {
+            if (g.drafted[g.n_drafted_accepted] == id) {
+                // Accept drafted token
+                const auto logits = g.drafted_logits.begin()+g.n_drafted_accepted*n_vocab;
+                state->logits.assign(logits, logits+n_vocab);
+                g.n_drafted_accepted++;
+                evaluated = true;
+            } else {
+                // Drop remaining drafted tokens
+                state->kv_self.n = state->tokens.size()-1;
+                g.drafted.clear();
+                g.n_drafted_accepted = 0;
+            }
+        }
+
+        // Make sure token limit isn't being hit, the new token is evaluated alongside the rest if scrolling was needed
+        const bool scrolled = window_scroll();
+
+        // Get token as string
+        const std::string_view str = state->vocab.id_to_token.at(id);
+
+        // Append string to function result
+        state->prompt.append(str);
+        mark_prompt_size(state->tokens.size(), state->prompt.size());
+        g.result.append(str);
+
+        // Tick
+        if (pre_tick && !pre_tick(str.data())) g.abort = true;
+        else if (!scrolled && !evaluated) {
+            // Let draft model or prompt lookup propose tokens following this one
+            g.drafted = get_drafted_tokens(state->tokens, params.n_ctx-state->tokens.size(), n_vocab);
+            g.n_drafted_accepted = 0;
+            // Evaluate token along with drafted ones, their logits are used to verify them one by one
+            std::vector<int> batch(state->tokens.begin()+state->tokens.size()-1, state->tokens.begin()+state->tokens.size());
+            batch.insert(batch.end(), g.drafted.begin(), g.drafted.end());
+            if (!gptj_eval(state->model, state->kv_self, state->buf, params.n_threads, state->tokens.size()-1, batch, state->logits, state->mem_per_token, !g.drafted.empty())) {
+                LM_THROW("Failed to evaluate new tokens", false);
+            }
+            g.drafted_logits.assign(state->logits.begin()+n_vocab, state->logits.end());
+            state->logits.resize(n_vocab);
+        }
+
+        // Tick
+        if (on_tick && !on_tick(str.data())) g.abort = true;
+
+        // Check if done
+        if (g.abort || (!g.end.empty() && g.result.find(g.end) != g.result.npos)) {
+            return finish_generation(g);
+        }
+        return true;
+    }
+
 public:
     GPTJInference(const std::string& weights_path, std::ifstream& f, const Params& p) : Inference(p) {
         init(weights_path, f);
@@ -135,6 +315,7 @@ public:
 
     LM_ERRBOOL append(const std::string& prompt, const AppendCallback &on_tick) LM_NOEXCEPTDECL override {
         auto& state = get_state();
+        mark_modified();
 
         // Append to current prompt
         state->prompt.append(prompt);
@@ -149,6 +330,7 @@ public:
                     std::make_move_iterator(tokens.begin()),
                     std::make_move_iterator(tokens.end())
         );
+        mark_prompt_size(state->tokens.size(), state->prompt.size());
 
         // Make sure token limit isn't being hit
         if (window_scroll()) {
@@ -160,91 +342,168 @@ public:
         return evaluate_tokens(old_token_count, on_tick);
     }
 
-    std::string run(std::string_view end, const GenerateCallback &on_tick, const GenerateCallback& pre_tick) LM_NOEXCEPTDECL override {
+    LM_ERRBOOL set_prompt(const std::string& prompt, const AppendCallback &on_tick) LM_NOEXCEPTDECL override {
         auto& state = get_state();
-        std::string fres;
+        mark_modified();
 
-        // Loop until done
-        bool abort = false;
-        unsigned eos_count = 0;
-        size_t last_size = 0;
-        while (!abort && (end.empty() || fres.find(end) == fres.npos)) {
-            last_size = fres.size();
-            // Sample top p and top k
-            const auto n_repeat_last = std::min<size_t>(state->tokens.size(), params.n_repeat_last);
-            auto id = gpt_sample_top_k_top_p(state->model.hparams.n_vocab, state->tokens.data()+state->tokens.size()-n_repeat_last, n_repeat_last, state->logits, params.top_k, params.top_p, params.temp, params.repeat_penalty, state->rng);
-
-            if (id == 50256) {
-                if (eos_count++ == params.n_eos_ignores) {
-                    abort = true;
-                    continue;
-                }
-                id = gpt_tokenize(state->vocab, "\n")[0];
+        // Run tokenizer
+        const auto tokens = gpt_tokenize(state->vocab, prompt);
+
+        // Find amount of tokens that are already evaluated
+        size_t n_keep = std::mismatch(tokens.begin(), tokens.end(), state->tokens.begin(), state->tokens.end()).first - tokens.begin();
+        if (n_keep == tokens.size()) {
+            // Nothing new, last token must be evaluated again if it isn't the last one anymore
+            if (n_keep == state->tokens.size() || n_keep == 0) {
+                truncate(n_keep);
+                state->prompt = prompt;
+                mark_prompt_size(state->tokens.size(), state->prompt.size());
+                return LM_BOOL_SUCCESS;
             }
+            n_keep--;
+        }
 
-            // Add token
-            state->tokens.push_back(id);
+        // Replace prompt and drop tokens that differ
+        state->prompt = prompt;
+        truncate(n_keep);
+        state->tokens.insert(state->tokens.end(), tokens.begin()+n_keep, tokens.end());
+        mark_prompt_size(state->tokens.size(), state->prompt.size());
 
-            // Make sure token limit isn't being hit
-            window_scroll();
+        // Make sure token limit isn't being hit
+        if (window_scroll()) {
+            // That function already has evaluated our tokens since scrolling was needed
+            return LM_BOOL_SUCCESS;
+        }
 
-            // Get token as string
-            const std::string_view str = state->vocab.id_to_token[id];
+        // Evaluate new tokens
+        return evaluate_tokens(n_keep, on_tick);
+    }
 
-            // Append string to function result
-            state->prompt.append(str);
-            fres.append(str);
+    LM_ERRBOOL rewind(unsigned n_tokens) LM_NOEXCEPTDECL override {
+        auto& state = get_state();
+        if (n_tokens >= state->tokens.size()) return LM_BOOL_SUCCESS;
+        mark_modified();
 
-            if (pre_tick && !pre_tick(str.data())) abort = true;
-            else {
-                // Evaluate token
-                //  TODO: Respect batch size
-                std::vector<int> batch(state->tokens.begin()+state->tokens.size()-1, state->tokens.begin()+state->tokens.size());
-                if (!gptj_eval(state->model, params.n_threads, state->tokens.size()-1, batch, state->logits, state->mem_per_token)) {
-                    LM_THROW("Failed to evaluate new tokens", "");
-                }
-            }
+        // Drop text of dropped tokens from prompt, cutting it where it was when the last kept token was added
+        state->prompt.resize(get_prompt_size(n_tokens, state->tokens, state->prompt.size(), [&state] (int id) {
+            return state->vocab.id_to_token.at(id).size();
+        }));
 
-            // Tick
-            if (on_tick && !on_tick(str.data())) abort = true;
+        // Drop tokens, last kept one is evaluated again to get its logits
+        if (n_tokens == 0) {
+            truncate(0);
+            return LM_BOOL_SUCCESS;
         }
+        const auto last_token = state->tokens[n_tokens-1];
+        truncate(n_tokens-1);
+        state->tokens.push_back(last_token);
+        mark_prompt_size(state->tokens.size(), state->prompt.size());
+        return evaluate_tokens(n_tokens-1);
+    }
 
-        // Create final string  TODO: Could be optimized
-        if (!abort) {
-            fres = std::string(fres.data(), last_size);
-        }
+    std::unique_ptr<Generation> generate(std::string_view end) LM_NOEXCEPTDECL override {
+        return std::make_unique<GPTJGeneration>(*this, end);
+    }
+
+    std::string run(std::string_view end, const GenerateCallback &on_tick, const GenerateCallback& pre_tick) LM_NOEXCEPTDECL override {
+        GPTJGeneration generation(*this, end);
+
+        // Loop until done
+        while (generation.step(on_tick, pre_tick));
+        if (!generation.is_done()) return "";
 
         // Return final string
+        return std::move(generation.result);
+    }
+
+    std::vector<int> predict_tokens(const std::vector<int>& tokens, unsigned n) LM_NOEXCEPTDECL override {
+        auto& state = get_state();
+        mark_modified();
+        std::vector<int> fres;
+
+        // Can't look past the end of the context
+        if (tokens.empty() || tokens.size()+n > params.n_ctx) return fres;
+
+        // Find amount of tokens that are already evaluated, logits of last one are needed
+        size_t n_keep = std::mismatch(tokens.begin(), tokens.end(), state->tokens.begin(), state->tokens.end()).first - tokens.begin();
+        if (n_keep == tokens.size() && n_keep != state->tokens.size()) n_keep--;
+
+        // Replace tokens that differ and evaluate them
+        truncate(n_keep);
+        state->tokens.insert(state->tokens.end(), tokens.begin()+n_keep, tokens.end());
+        LM_ERROR_CATCH(evaluate_tokens(n_keep), LM_BOOL_ERROR, {LM_RETHROW(fres);});
+
+        // Predict tokens greedily
+        while (fres.size() != n) {
+            const int id = std::max_element(state->logits.begin(), state->logits.end()) - state->logits.begin();
+            fres.push_back(id);
+            // Last token doesn't need to be evaluated
+            if (fres.size() == n) break;
+            // Evaluate token
+            state->tokens.push_back(id);
+            if (!gptj_eval(state->model, state->kv_self, state->buf, params.n_threads, state->tokens.size()-1, {id}, state->logits, state->mem_per_token)) {
+                state->tokens.pop_back();
+                LM_THROW("Failed to evaluate predicted tokens", fres);
+            }
+        }
+
         return fres;
     }
 
     unsigned get_context_size() const noexcept override {
         return get_state()->tokens.size();
     }
+    size_t get_memory_usage() const noexcept override {
+        auto& state = get_state();
+        // The eval scratch buffer is left out, its size doesn't depend on the session
+        return state->kv_self.buf.size + state->logits.size()*sizeof(float) + state->tokens.size()*sizeof(int);
+    }
 
     LM_ERRBOOL create_savestate(Savestate &sv) const LM_NOEXCEPTDECL override {
         auto& state = get_state();
-        sv.buf.resize(gptj_get_state_size(state->model));
-        gptj_copy_state_data(state->model, state->rng, sv.buf.data());
+        sv.buf.resize(gptj_get_state_size(state->model.hparams, state->kv_self, state->rng));
+        gptj_copy_state_data(state->model.hparams, state->kv_self, state->rng, sv.buf.data());
         sv.tokens = state->tokens;
         sv.prompt = state->prompt;
+        sv.prompt_marks = prompt_marks;
         sv.ctx = generic_state;
         return LM_BOOL_SUCCESS;
     }
     LM_ERRBOOL restore_savestate(const Savestate &sv) LM_NOEXCEPTDECL override {
         auto& state = get_state();
+        mark_modified();
         if (sv.ctx != generic_state)
             LM_THROW("Savestate does not match context", LM_BOOL_ERROR);
-        gptj_set_state_data(&state->model, &state->rng, sv.buf.data());
+        if (!gptj_set_state_data(state->model.hparams, &state->kv_self, &state->rng, sv.buf.data())) {
+            LM_THROW("Failed to restore savestate", LM_BOOL_ERROR);
+        }
         state->tokens = sv.tokens;
         state->prompt = sv.prompt;
+        prompt_marks = sv.prompt_marks;
+        return LM_BOOL_SUCCESS;
+    }
+
+    LM_ERRBOOL reset() LM_NOEXCEPTDECL override {
+        auto& state = get_state();
+        reset_base();
+        state->tokens.clear();
+        state->prompt.clear();
+        state->logits.clear();
+        state->saved_tokens.clear();
+        state->saved_prompt.clear();
+        state->rng.seed(params.seed);
+        // Shrink KV cache back to its initial size, it grows again as needed
+        state->kv_self.n = 0;
+        if (state->kv_self.n_ctx > int(get_initial_context_size()) && !gptj_kv_cache_resize(state->model.hparams, state->kv_self, get_initial_context_size())) {
+            LM_THROW("Failed to shrink KV cache", LM_BOOL_ERROR);
+        }
+        state->kv_self.n_saved = 0;
         return LM_BOOL_SUCCESS;
     }
 
     LM_ERRBOOL serialize(std::ostream &o) const LM_NOEXCEPTDECL override {
         auto& state = get_state();
         // Get state size
-        auto state_size = gptj_get_state_size(state->model);
+        auto state_size = gptj_get_state_size(state->model.hparams, state->kv_self, state->rng);
         // Write sizes
         for (const uint32_t s : {state->tokens.size(), state->prompt.size(), state_size}) {
             if (!o.write(reinterpret_cast<const char*>(&s), sizeof(s))) {
@@ -260,15 +519,14 @@ public:
             LM_THROW("Failed to serialize prompt", LM_BOOL_ERROR);
         }
         // Write state
-        std::vector<uint8_t> state_buf(state_size);
-        gptj_copy_state_data(state->model, state->rng, state_buf.data());
-        if (!o.write(reinterpret_cast<const char*>(state_buf.data()), state_size)) {
+        if (!gptj_write_state_data(state->model.hparams, state->kv_self, state->rng, o, params.quantize_serialized_kv)) {
             LM_THROW("Failed to serialize state", LM_BOOL_ERROR);
         }
         return LM_BOOL_SUCCESS;
     }
     LM_ERRBOOL deserialize(std::istream &i) LM_NOEXCEPTDECL override {
         auto& state = get_state();
+        mark_modified();
         uint32_t embd_size, prompt_size, state_size;
         // Initialization to prevent compiler complaints
         embd_size = prompt_size = state_size = 0;
@@ -288,16 +546,86 @@ public:
         if (!i.read(state->prompt.data(), state->prompt.size())) {
             LM_THROW("Failed to deserialize prompt", LM_BOOL_ERROR);
         }
+        // Where text was added to the prompt isn't serialized
+        prompt_marks.clear();
         // Read state
-        std::vector<uint8_t> state_buf(state_size);
-        if (!i.read(reinterpret_cast<char*>(state_buf.data()), state_buf.size())) {
+        if (!gptj_read_state_data(state->model.hparams, &state->kv_self, &state->rng, i)) {
             LM_THROW("Failed to deserialize state", LM_BOOL_ERROR);
         }
-        gptj_set_state_data(&state->model, &state->rng, state_buf.data());
+        return LM_BOOL_SUCCESS;
+    }
+    LM_ERRBOOL serialize_delta(std::ostream &o, bool full) LM_NOEXCEPTDECL override {
+        auto& state = get_state();
+        if (full) {
+            state->saved_tokens.clear();
+            state->saved_prompt.clear();
+        }
+        // Keep what tokens and prompt have in common with the ones written last time
+        const uint32_t tokens_keep = std::mismatch(state->tokens.begin(), state->tokens.end(), state->saved_tokens.begin(), state->saved_tokens.end()).first - state->tokens.begin();
+        const uint32_t prompt_keep = std::mismatch(state->prompt.begin(), state->prompt.end(), state->saved_prompt.begin(), state->saved_prompt.end()).first - state->prompt.begin();
+        // Write sizes
+        for (const uint32_t s : {tokens_keep, uint32_t(state->tokens.size()), prompt_keep, uint32_t(state->prompt.size())}) {
+            if (!o.write(reinterpret_cast<const char*>(&s), sizeof(s))) {
+                LM_THROW("Failed to serialize data sizes", LM_BOOL_ERROR);
+            }
+        }
+        // Write added tokens
+        if (!o.write(reinterpret_cast<const char*>(state->tokens.data()+tokens_keep), (state->tokens.size()-tokens_keep)*sizeof(int))) {
+            LM_THROW("Failed to serialize tokens", LM_BOOL_ERROR);
+        }
+        // Write added prompt
+        if (!o.write(state->prompt.data()+prompt_keep, state->prompt.size()-prompt_keep)) {
+            LM_THROW("Failed to serialize prompt", LM_BOOL_ERROR);
+        }
+        // Write changed state
+        if (!gptj_write_state_delta(state->model.hparams, state->kv_self, state->rng, o, params.quantize_serialized_kv, full)) {
+            LM_THROW("Failed to serialize state", LM_BOOL_ERROR);
+        }
+        state->saved_tokens = state->tokens;
+        state->saved_prompt = state->prompt;
+        return LM_BOOL_SUCCESS;
+    }
+    LM_ERRBOOL deserialize_delta(std::istream &i) LM_NOEXCEPTDECL override {
+        auto& state = get_state();
+        mark_modified();
+        uint32_t tokens_keep, tokens_size, prompt_keep, prompt_size;
+        // Initialization to prevent compiler complaints
+        tokens_keep = tokens_size = prompt_keep = prompt_size = 0;
+        // Read sizes
+        for (uint32_t *s : {&tokens_keep, &tokens_size, &prompt_keep, &prompt_size}) {
+            if (!i.read(reinterpret_cast<char*>(s), sizeof(*s))) {
+                LM_THROW("Failed to deserialize data sizes", LM_BOOL_ERROR);
+            }
+        }
+        if (tokens_keep > state->tokens.size() || tokens_keep > tokens_size || prompt_keep > state->prompt.size() || prompt_keep > prompt_size) {
+            LM_THROW("Delta does not match current state", LM_BOOL_ERROR);
+        }
+        // Read added tokens
+        state->tokens.resize(tokens_size);
+        if (!i.read(reinterpret_cast<char*>(state->tokens.data()+tokens_keep), (tokens_size-tokens_keep)*sizeof(int))) {
+            LM_THROW("Failed to deserialize tokens", LM_BOOL_ERROR);
+        }
+        // Read added prompt
+        state->prompt.resize(prompt_size);
+        if (!i.read(state->prompt.data()+prompt_keep, prompt_size-prompt_keep)) {
+            LM_THROW("Failed to deserialize prompt", LM_BOOL_ERROR);
+        }
+        // Where text was added to the prompt isn't serialized
+        prompt_marks.clear();
+        // Read changed state
+        if (!gptj_read_state_delta(state->model.hparams, &state->kv_self, &state->rng, i)) {
+            LM_THROW("Failed to deserialize state", LM_BOOL_ERROR);
+        }
+        state->saved_tokens = state->tokens;
+        state->saved_prompt = state->prompt;
         return LM_BOOL_SUCCESS;
     }
     const std::string &get_prompt() const LM_NOEXCEPTDECL override {
         return get_state()->prompt;
     }
+
+    bool is_delta_serialization_available() const noexcept override {
+        return true;
+    }
 };
 }
@@ -1,6 +1,10 @@
 #include "justlm.hpp"
+#include "model_registry.hpp"
 
 #include <cstring>
+#include <cmath>
+#include <memory>
+#include <algorithm>
 #include <ggml.h>
 #include <llama.h>
 #include <common/grammar-parser.h>
@@ -8,15 +12,53 @@
 
 namespace LM {
 class LLaMAInference final : public Inference {
+    // Shared between all sequences of a context
+    struct Context {
+        llama_context *ctx = nullptr;
+        llama_context_params lparams; // Parameters context was created with, used to recreate it when resizing
+        std::shared_ptr<llama_model> model; // Shared between all contexts using the same weights
+        std::vector<bool> sequences; // Sequence IDs in use
+        bool can_shift = false; // If KV cache entries can be moved to other positions without evaluating them again
+
+        ~Context() {
+            if (ctx) llama_free(ctx);
+        }
+    };
+
     struct State {
+        std::shared_ptr<Context> context;
         llama_context *ctx = nullptr;
         llama_model *model;
+        llama_seq_id seq_id = 0;
         llama_grammar *grammar = nullptr;
         bool grammar_override_temp;
         grammar_parser::parse_state parsed_grammar;
         std::string prompt; // Mostly here for easy "debugging"
         std::vector<int> tokens;
-        unsigned n_ctx;
+        std::vector<float> logits; // Logits of last evaluated token, kept since other sequences may overwrite the contexts ones
+        unsigned n_ctx; // Amount of tokens there currently is room for, may grow up to Params::n_ctx
+        bool shares_cells = false; // Set once KV cache cells may be shared with other sequences (see fork()), shifting them would move them in those too
+    };
+
+    struct Batch {
+        llama_batch batch;
+
+        Batch(int32_t n_tokens) : batch(llama_batch_init(n_tokens, 0, 1)) {}
+        ~Batch() {
+            llama_batch_free(batch);
+        }
+
+        void clear() {
+            batch.n_tokens = 0;
+        }
+        void add(int token, llama_pos pos, llama_seq_id seq_id, bool logits) {
+            const auto i = batch.n_tokens++;
+            batch.token[i] = token;
+            batch.pos[i] = pos;
+            batch.n_seq_id[i] = 1;
+            batch.seq_id[i][0] = seq_id;
+            batch.logits[i] = logits;
+        }
     };
 
     State*& get_state() {
@@ -31,75 +73,159 @@ class LLaMAInference final : public Inference {
 
         // Allocate state
         state = new State;
+        state->context = std::make_shared<Context>();
 
         // Get llama parameters
         auto lparams = llama_context_default_params();
         lparams.seed = params.seed;
         lparams.n_ctx = params.n_ctx = params.n_ctx>0?params.n_ctx:2024;
+        params.n_seq_max = params.n_seq_max>0?params.n_seq_max:1;
+        if (params.n_seq_max == 1 && params.n_ctx_initial) {
+            // Context will be grown as needed, contexts shared between sequences can't be
+            lparams.n_ctx = std::min(params.n_ctx, params.n_ctx_initial);
+        }
+        lparams.n_ctx *= params.n_seq_max;
         lparams.n_threads = params.n_threads;
         //lparams.n_threads_batch = params.n_threads;  TODO: Is this sane?
 
         // Get model parameters
         auto mparams = llama_model_default_params();
+        mparams.use_mmap = params.use_mmap;
         mparams.use_mlock = params.use_mlock;
         mparams.n_gpu_layers = params.n_gpu_layers;
 
-        // Load model
-        state->model = llama_load_model_from_file(weights_path.c_str(), mparams);
+        // Get model, loading it only if no other instance uses the same weights yet
+        const auto model_key = weights_path+'\n'+std::to_string(mparams.n_gpu_layers)+'\n'+std::to_string(mparams.use_mmap)+'\n'+std::to_string(mparams.use_mlock);
+        state->context->model = ModelRegistry<llama_model>::get_instance().get(model_key, [&] () {
+            return std::shared_ptr<llama_model>(llama_load_model_from_file(weights_path.c_str(), mparams), llama_free_model);
+        });
+        state->model = state->context->model.get();
         if (!state->model) {
             LM_THROW("Failed to initialize llama model from file", LM_BOOL_ERROR);
         }
 
         // Create context
-        state->ctx = llama_new_context_with_model(state->model, lparams);
+        state->context->lparams = lparams;
+        state->ctx = state->context->ctx = llama_new_context_with_model(state->model, lparams);
         if (!state->ctx) {
             LM_THROW("Failed to initialize llama context from model", LM_BOOL_ERROR);
         }
 
         // Initialize some variables
-        state->n_ctx = llama_n_ctx(state->ctx);
+        state->n_ctx = llama_n_ctx(state->ctx) / params.n_seq_max;
+        state->context->sequences.resize(params.n_seq_max, false);
+        state->context->sequences[0] = true;
+
+        // Check if KV cache can be shifted, only architectures using RoPE support that since their K cache is rotated by the shift
+        // The llama.cpp API doesn't expose the rope type yet, so these are all RoPE architectures it knows about. ALiBi and learned position embeddings (mpt, bloom, refact, starcoder, gpt2) can't be shifted
+        char arch[32] = "";
+        llama_model_meta_val_str(state->model, "general.architecture", arch, sizeof(arch));
+        for (const char *shiftable_arch : {"llama", "baichuan", "falcon", "persimmon", "gptneox", "stablelm", "qwen", "phi2"}) {
+            if (std::strcmp(arch, shiftable_arch) == 0) state->context->can_shift = true;
+        }
+
+        return LM_BOOL_SUCCESS;
+    }
+
+    // Replaces context by one with room for given amount of tokens, the KV cache is lost in the process
+    LM_ERRBOOL resize_context(unsigned n_ctx) LM_NOEXCEPTDECL {
+        auto& state = get_state();
+        auto& context = *state->context;
+
+        // RNG state can't be carried over, so derive a new seed
+        auto lparams = context.lparams;
+        lparams.n_ctx = n_ctx;
+        lparams.seed += state->tokens.size();
+
+        // Replace context
+        auto ctx = llama_new_context_with_model(state->model, lparams);
+        if (!ctx) {
+            LM_THROW("Failed to resize llama context", LM_BOOL_ERROR);
+        }
+        llama_free(context.ctx);
+        state->ctx = context.ctx = ctx;
+        state->n_ctx = llama_n_ctx(ctx);
+
+        return LM_BOOL_SUCCESS;
+    }
 
+    // Makes sure there is room for given amount of tokens, up to the context size
+    // Since contexts can only grow by being recreated, n_evaluated is set to 0 if that happens
+    LM_ERRBOOL grow_context(size_t n_tokens, size_t& n_evaluated) LM_NOEXCEPTDECL {
+        auto& state = get_state();
+        if (n_tokens <= state->n_ctx || state->n_ctx >= params.n_ctx) return LM_BOOL_SUCCESS;
+        // Grow geometrically, so tokens only have to be evaluated again a few times
+        LM_ERROR_FORWARD(resize_context(std::min<size_t>(params.n_ctx, std::max<size_t>(n_tokens, state->n_ctx*2))), LM_BOOL_ERROR);
+        n_evaluated = 0;
         return LM_BOOL_SUCCESS;
     }
 
     // This function reduces the size of our tokens vector according to some parameters
-    // All tokens will be evaluated if scrolling was needed and true will be returned
-    bool window_scroll() LM_NOEXCEPTDECL {
+    // All tokens not evaluated yet will be evaluated if scrolling was needed and true will be returned
+    bool window_scroll(size_t n_evaluated) LM_NOEXCEPTDECL {
         auto &state = get_state();
         // Check that we actually need to scroll
-        if (state->tokens.size() <= state->n_ctx) {
+        if (state->tokens.size() <= params.n_ctx) {
             // Nope
             return false;
         }
-        // Start scrolling
+        // Get range of tokens to discard
+        const size_t discard_begin = params.n_ctx_window_top_bar;
+        size_t discard_end = state->tokens.size();
         if (params.scroll_keep > 0.0f) {
             // "Scroll" down the context window...
             unsigned keep_count = float(state->tokens.size() - params.n_ctx_window_top_bar) * 0.4f; // We keep about 40%
-            // Get vector of tokens to keep
-            std::vector<int> tokens_in_view(state->tokens.end()-keep_count, state->tokens.end());
-            // Cut down tokens vector size
-            state->tokens.resize(params.n_ctx_window_top_bar+keep_count);
-            // Overwrite tokens after top bar with tokens in view
-            std::memcpy(state->tokens.data()+params.n_ctx_window_top_bar, tokens_in_view.data(), tokens_in_view.size()*sizeof(int));
+            discard_end -= keep_count;
+        }
+        const size_t discard_count = discard_end - discard_begin;
+        // Cut discarded tokens out of tokens vector
+        state->tokens.erase(state->tokens.begin()+discard_begin, state->tokens.begin()+discard_end);
+        cut_prompt_marks(discard_begin, discard_end);
+        if (state->context->can_shift && !state->shares_cells) {
+            // Remove discarded tokens from KV cache and move the kept ones into their place
+            llama_kv_cache_seq_rm(state->ctx, state->seq_id, discard_begin, discard_end);
+            llama_kv_cache_seq_shift(state->ctx, state->seq_id, discard_end, -1, -llama_pos(discard_count));
+            // Only kept tokens that have been evaluated before don't need to be evaluated again
+            if (n_evaluated > discard_end) n_evaluated -= discard_count;
+            else n_evaluated = std::min(n_evaluated, discard_begin);
         } else {
-            // Cut down tokens vector size to top bar
-            state->tokens.resize(params.n_ctx_window_top_bar);
+            // Evaluate all tokens again
+            llama_kv_cache_seq_rm(state->ctx, state->seq_id, -1, -1);
+            n_evaluated = 0;
         }
         // Evaluate tokens
-        LM_ERROR_FORWARD(evaluate_tokens(0, on_scroll), LM_BOOL_ERROR);
+        LM_ERROR_FORWARD(evaluate_tokens(n_evaluated, on_scroll), LM_BOOL_ERROR);
         return true;
     }
 
+    // Drops all tokens from given position on, including their KV cache entries
+    void truncate(size_t n_tokens) {
+        auto& state = get_state();
+        llama_kv_cache_seq_rm(state->ctx, state->seq_id, n_tokens, -1);
+        state->tokens.resize(n_tokens);
+        drop_prompt_marks(n_tokens);
+    }
+
+    // Copies the logits of given batch index out of the context
+    void store_logits(int32_t idx = 0) {
+        auto& state = get_state();
+        const auto logits = llama_get_logits_ith(state->ctx, idx);
+        state->logits.assign(logits, logits+llama_n_vocab(state->model));
+    }
+
     LM_ERRBOOL evaluate_tokens(size_t starting_offset, const AppendCallback &on_tick = nullptr) LM_NOEXCEPTDECL {
         auto& state = get_state();
 
+        // Make sure there is room for all tokens
+        LM_ERROR_FORWARD(grow_context(state->tokens.size(), starting_offset), LM_BOOL_ERROR);
+
         // Evaluate tokens in batches
         unsigned it;
         for (it = starting_offset; ; it += params.n_batch) {
             if (it + params.n_batch >= ssize_t(state->tokens.size())) break;
 
             // Evaluate
-            const auto batch = llama_batch_get_one(state->tokens.data()+it, params.n_batch, it, 0);
+            const auto batch = llama_batch_get_one(state->tokens.data()+it, params.n_batch, it, state->seq_id);
             if (llama_decode(state->ctx, batch)) {
                 LM_THROW("Failed to evaluate tokens in batches", LM_BOOL_ERROR);
             }
@@ -109,19 +235,23 @@ class LLaMAInference final : public Inference {
                 // Calculate progress
                 auto progress = float(it-starting_offset) / (state->tokens.size()-starting_offset) * 100.f;
                 // Tick and yield
-                if (!on_tick(progress)) return LM_BOOL_SUCCESS;
+                if (!on_tick(progress)) {
+                    store_logits();
+                    return LM_BOOL_SUCCESS;
+                }
             }
         }
 
         // Evaluate remaining tokens
         if (it < state->tokens.size()) {
             for (; it != state->tokens.size(); it++) {
-                const auto batch = llama_batch_get_one(state->tokens.data()+it, 1, it, 0);
+                const auto batch = llama_batch_get_one(state->tokens.data()+it, 1, it, state->seq_id);
                 if (llama_decode(state->ctx, batch)) {
                     LM_THROW("Failed to evaluate individual tokens", LM_BOOL_ERROR);
                 }
             }
         }
+        if (starting_offset < state->tokens.size()) store_logits();
 
         // Notify about completion
         if (on_tick) on_tick(100.f);
@@ -138,7 +268,7 @@ class LLaMAInference final : public Inference {
 
     int llama_sample_top_p_top_k() {
         auto& state = get_state();
-        auto logits = llama_get_logits(state->ctx);
+        const auto& logits = state->logits;
         auto n_vocab = llama_n_vocab(state->model);
         // Populate initial list of all candidates
         std::vector<llama_token_data> candidates;
@@ -184,6 +314,200 @@ class LLaMAInference final : public Inference {
         }
     }
 
+    struct LLaMAGeneration final : public Generation {
+        LLaMAInference& inference;
+        std::string end;
+        std::string result;
+        size_t last_size = 0;
+        unsigned eos_count = 0;
+        bool abort = false;
+        bool done = false;
+
+        // Tokens drafted by draft model or prompt lookup that have been evaluated past the end of the context but not accepted yet
+        std::vector<int> drafted;
+        std::vector<float> drafted_logits;
+        size_t n_drafted_accepted = 0;
+        Batch batch;
+
+        LLaMAGeneration(LLaMAInference& inference, std::string_view end)
+            : inference(inference), end(end), batch(1+inference.get_max_drafted_tokens()) {}
+        ~LLaMAGeneration() override {
+            if (!done) inference.finish_generation(*this);
+        }
+
+        bool step(const GenerateCallback& on_tick, const GenerateCallback& pre_tick) LM_NOEXCEPTDECL override {
+            return inference.generation_step(*this, on_tick, pre_tick);
+        }
+
+        const std::string& get_result() const noexcept override {
+            return result;
+        }
+        bool is_done() const noexcept override {
+            return done;
+        }
+    };
+
+    // Drops drafted tokens that haven't been accepted along with their KV cache cells
+    void drop_drafted_tokens(LLaMAGeneration& g) {
+        auto& state = get_state();
+        if (g.n_drafted_accepted != g.drafted.size()) {
+            llama_kv_cache_seq_rm(state->ctx, state->seq_id, state->tokens.size(), -1);
+        }
+        g.drafted.clear();
+        g.n_drafted_accepted = 0;
+    }
+
+    // Ends given generation, returns false for convenience
+    bool finish_generation(LLaMAGeneration& g) {
+        drop_drafted_tokens(g);
+
+        // Create final string
+        if (!g.abort && g.result.size() > g.end.size()) {
+            g.result.resize(g.last_size);
+        }
+
+        g.done = true;
+        return false;
+    }
+
+    bool generation_step(LLaMAGeneration& g, const GenerateCallback &on_tick, const GenerateCallback& pre_tick) LM_NOEXCEPTDECL {
+        auto& state = get_state();
+        mark_modified();
+        const auto n_vocab = llama_n_vocab(state->model);
+
+        // Check if done
+        if (g.done) return false;
+        if (g.is_cancelled()) {
+            g.abort = true;
+            return finish_generation(g);
+        }
+
+        g.last_size = g.result.size();
+        // Sample top p and top k
+        int id;
+        try {
+            id = llama_sample_top_p_top_k();
+        } catch (const std::exception& e) {
+            LM_THROW(e.what(), false);
+        }
+
+        if (id == llama_token_eos(state->model)) {
+            if (g.eos_count++ == params.n_eos_ignores) {
+                g.abort = true;
+                return finish_generation(g);
+            }
+            state->tokens.push_back(0);
+            llama_tokenize(state->model, "\n", 1, &state->tokens.back(), 1, false, false);
+            id = state->tokens.back();
+        } else {
+            // Add token
+            state->tokens.push_back(id);
+        }
+
+        // Check if token has been drafted and therefore evaluated already
+        bool evaluated = false;
+        if (g.n_drafted_accepted != g.drafted.size()) {
+            if (g.drafted[g.n_drafted_accepted] == id) {
+                // Accept drafted token
+                const auto logits = g.drafted_logits.begin()+g.n_drafted_accepted*n_vocab;
+                state->logits.assign(logits, logits+n_vocab);
+                g.n_drafted_accepted++;
+                evaluated = true;
+            } else {
+                // Drop remaining drafted tokens
+                llama_kv_cache_seq_rm(state->ctx, state->seq_id, state->tokens.size()-1, -1);
+                g.drafted.clear();
+                g.n_drafted_accepted = 0;
+            }
+        }
+
+        // Make sure token limit isn't hit, the new token is evaluated alongside the rest if scrolling was needed
+        // Scrolling moves or drops KV cache cells, so drafted tokens that haven't been accepted yet need to go first
+        if (state->tokens.size() > params.n_ctx) drop_drafted_tokens(g);
+        const bool scrolled = window_scroll(evaluated?state->tokens.size():state->tokens.size()-1);
+
+        // Get token as string
+        std::string str(14, ' ');
+        str.resize(llama_token_to_piece(state->model, id, str.data(), 14));
+
+        // Append string to function result
+        state->prompt.append(str);
+        mark_prompt_size(state->tokens.size(), state->prompt.size());
+        g.result.append(str);
+
+        // Tick
+        if (pre_tick && !pre_tick(str.data())) g.abort = true;
+        else if (!scrolled && !evaluated) {
+            // Let draft model or prompt lookup propose tokens following this one
+            g.drafted = get_drafted_tokens(state->tokens, params.n_ctx-state->tokens.size(), n_vocab);
+            g.n_drafted_accepted = 0;
+            // Make sure there is room for the token and drafted ones
+            size_t n_evaluated = state->tokens.size()-1;
+            LM_ERROR_FORWARD(grow_context(state->tokens.size()+g.drafted.size(), n_evaluated), false);
+            if (n_evaluated != state->tokens.size()-1) {
+                // Context has been recreated, so evaluate all tokens again and skip drafting this time
+                g.drafted.clear();
+                LM_ERROR_FORWARD(evaluate_tokens(0), false);
+            } else {
+                // Evaluate token along with drafted ones, their logits are used to verify them one by one
+                g.batch.clear();
+                g.batch.add(id, state->tokens.size()-1, state->seq_id, true);
+                for (size_t it = 0; it != g.drafted.size(); it++) {
+                    g.batch.add(g.drafted[it], state->tokens.size()+it, state->seq_id, true);
+                }
+                if (llama_decode(state->ctx, g.batch.batch)) {
+                    LM_THROW("Failed to evaluate new tokens", false);
+                }
+                store_logits();
+                g.drafted_logits.resize(g.drafted.size()*n_vocab);
+                for (size_t it = 0; it != g.drafted.size(); it++) {
+                    std::memcpy(g.drafted_logits.data()+it*n_vocab, llama_get_logits_ith(state->ctx, 1+it), n_vocab*sizeof(float));
+                }
+            }
+        }
+
+        // Tick and yield
+        if (on_tick && !on_tick(str.data())) g.abort = true;
+
+        // Check if done
+        if (g.abort || (!g.end.empty() && g.result.find(g.end) != g.result.npos)) {
+            return finish_generation(g);
+        }
+        return true;
+    }
+
+    // Savestates contain the whole context and may therefore only be used while no other sequences exist
+    // Returns -1 if all sequences of the context are in use
+    llama_seq_id get_free_sequence() const {
+        const auto& sequences = get_state()->context->sequences;
+        for (llama_seq_id seq_id = 0; seq_id != llama_seq_id(sequences.size()); seq_id++) {
+            if (!sequences[seq_id]) return seq_id;
+        }
+        return -1;
+    }
+
+    bool is_context_exclusive() const {
+        auto& state = get_state();
+        if (state->seq_id != 0) return false;
+        for (size_t it = 1; it != state->context->sequences.size(); it++) {
+            if (state->context->sequences[it]) return false;
+        }
+        return true;
+    }
+
+    LLaMAInference(const std::shared_ptr<Context>& context, llama_seq_id seq_id, const Params& p) : Inference(p) {
+        auto& state = get_state();
+
+        // Allocate state
+        state = new State;
+        state->context = context;
+        state->ctx = context->ctx;
+        state->model = context->model.get();
+        state->seq_id = seq_id;
+        state->n_ctx = params.n_ctx;
+        context->sequences[seq_id] = true;
+    }
+
 public:
     LLaMAInference(const std::string& weights_path, const Params& p) : Inference(p) {
         init(weights_path);
@@ -192,13 +516,19 @@ public:
         auto& state = get_state();
 
         if (state) {
-            if (state->ctx) llama_free(state->ctx);
+            if (state->ctx) {
+                // Give sequence back to context
+                llama_kv_cache_seq_rm(state->ctx, state->seq_id, -1, -1);
+                state->context->sequences[state->seq_id] = false;
+            }
+            if (state->grammar) llama_grammar_free(state->grammar);
             delete state;
         }
     }
 
     LM_ERRBOOL append(const std::string& prompt, const AppendCallback &on_tick) LM_NOEXCEPTDECL override {
         auto& state = get_state();
+        mark_modified();
 
         // Check if prompt was empty
         const bool was_empty = state->prompt.empty();
@@ -213,9 +543,10 @@ public:
         // Run tokenizer
         const auto token_count = llama_tokenize(state->model, prompt.c_str(), prompt.size(), state->tokens.data()+old_token_count, state->tokens.size()-old_token_count, was_empty, false);
         state->tokens.resize(old_token_count+token_count);
+        mark_prompt_size(state->tokens.size(), state->prompt.size());
 
         // Make sure token limit isn't being hit
-        if (window_scroll()) {
+        if (window_scroll(old_token_count)) {
             // That function already has evaluated our tokens since scrolling was needed
             return LM_BOOL_SUCCESS;
         }
@@ -224,97 +555,189 @@ public:
         return evaluate_tokens(old_token_count, on_tick);
     }
 
-    std::string run(std::string_view end, const GenerateCallback &on_tick, const GenerateCallback& pre_tick) LM_NOEXCEPTDECL override {
+    LM_ERRBOOL set_prompt(const std::string& prompt, const AppendCallback &on_tick) LM_NOEXCEPTDECL override {
         auto& state = get_state();
-        std::string fres;
+        mark_modified();
 
-        // Loop until done
-        bool abort = false;
-        unsigned eos_count = 0;
-        size_t last_size = 0;
-        while (!abort && (end.empty() || fres.find(end) == fres.npos)) {
-            last_size = fres.size();
-            // Sample top p and top k
-            int id;
-            try {
-                id = llama_sample_top_p_top_k();
-            } catch (const std::exception& e) {
-                LM_THROW(e.what(), "");
-            }
+        // Run tokenizer
+        std::vector<int> tokens(prompt.size()+1);
+        tokens.resize(llama_tokenize(state->model, prompt.c_str(), prompt.size(), tokens.data(), tokens.size(), true, false));
 
-            if (id == llama_token_eos(state->model)) {
-                if (eos_count++ == params.n_eos_ignores) {
-                    abort = true;
-                    continue;
-                }
-                state->tokens.push_back(0);
-                llama_tokenize(state->model, "\n", 1, &state->tokens.back(), 1, false, false);
-                id = state->tokens.back();
-            } else {
-                // Add token
-                state->tokens.push_back(id);
+        // Find amount of tokens that are already evaluated
+        size_t n_keep = std::mismatch(tokens.begin(), tokens.end(), state->tokens.begin(), state->tokens.end()).first - tokens.begin();
+        if (n_keep == tokens.size()) {
+            // Nothing new, last token must be evaluated again if it isn't the last one anymore
+            if (n_keep == state->tokens.size() || n_keep == 0) {
+                truncate(n_keep);
+                state->prompt = prompt;
+                mark_prompt_size(state->tokens.size(), state->prompt.size());
+                return LM_BOOL_SUCCESS;
             }
+            n_keep--;
+        }
 
-            // Make sure token limit isn't hit
-            window_scroll();
-
-            // Get token as string
-            std::string str(14, ' ');
-            str.resize(llama_token_to_piece(state->model, id, str.data(), 14));
+        // Replace prompt and drop tokens that differ
+        state->prompt = prompt;
+        truncate(n_keep);
+        state->tokens.insert(state->tokens.end(), tokens.begin()+n_keep, tokens.end());
+        mark_prompt_size(state->tokens.size(), state->prompt.size());
 
-            // Append string to function result
-            state->prompt.append(str);
-            fres.append(str);
+        // Make sure token limit isn't being hit
+        if (window_scroll(n_keep)) {
+            // That function already has evaluated our tokens since scrolling was needed
+            return LM_BOOL_SUCCESS;
+        }
 
-            // Tick
-            if (pre_tick && !pre_tick(str.data())) abort = true;
-            else {
-                // Evaluate token
-                //  TODO: Respect batch size
-                const auto batch = llama_batch_get_one(state->tokens.data()+state->tokens.size()-1, 1, state->tokens.size()-1, 0);
-                if (llama_decode(state->ctx, batch)) {
-                    LM_THROW("Failed to evaluate new tokens", "");
-                }
-            }
+        // Evaluate new tokens
+        return evaluate_tokens(n_keep, on_tick);
+    }
 
-            // Tick and yield
-            if (on_tick && !on_tick(str.data())) abort = true;
+    LM_ERRBOOL rewind(unsigned n_tokens) LM_NOEXCEPTDECL override {
+        auto& state = get_state();
+        if (n_tokens >= state->tokens.size()) return LM_BOOL_SUCCESS;
+        if (state->grammar) {
+            LM_THROW("Rewinding is not available while a grammar is loaded", LM_BOOL_ERROR);
         }
+        mark_modified();
 
-        // Create final string  TODO: Could be optimized
-        if (!abort && fres.size() > end.size()) {
-            fres = std::string(fres.data(), last_size);
+        // Drop text of dropped tokens from prompt, cutting it where it was when the last kept token was added
+        state->prompt.resize(get_prompt_size(n_tokens, state->tokens, state->prompt.size(), [&state] (int id) {
+            std::string str(14, ' ');
+            return size_t(llama_token_to_piece(state->model, id, str.data(), 14));
+        }));
+
+        // Drop tokens, last kept one is evaluated again to get its logits
+        if (n_tokens == 0) {
+            truncate(0);
+            return LM_BOOL_SUCCESS;
         }
+        const auto last_token = state->tokens[n_tokens-1];
+        truncate(n_tokens-1);
+        state->tokens.push_back(last_token);
+        mark_prompt_size(state->tokens.size(), state->prompt.size());
+        return evaluate_tokens(n_tokens-1);
+    }
+
+    std::unique_ptr<Generation> generate(std::string_view end) LM_NOEXCEPTDECL override {
+        return std::make_unique<LLaMAGeneration>(*this, end);
+    }
+
+    std::string run(std::string_view end, const GenerateCallback &on_tick, const GenerateCallback& pre_tick) LM_NOEXCEPTDECL override {
+        LLaMAGeneration generation(*this, end);
+
+        // Loop until done
+        while (generation.step(on_tick, pre_tick));
+        if (!generation.is_done()) return "";
 
         // Return final string
+        return std::move(generation.result);
+    }
+
+    std::vector<int> predict_tokens(const std::vector<int>& tokens, unsigned n) LM_NOEXCEPTDECL override {
+        auto& state = get_state();
+        mark_modified();
+        std::vector<int> fres;
+
+        // Can't look past the end of the context
+        if (tokens.empty() || tokens.size()+n > params.n_ctx) return fres;
+
+        // Find amount of tokens that are already evaluated, logits of last one are needed
+        size_t n_keep = std::mismatch(tokens.begin(), tokens.end(), state->tokens.begin(), state->tokens.end()).first - tokens.begin();
+        if (n_keep == tokens.size() && n_keep != state->tokens.size()) n_keep--;
+
+        // Replace tokens that differ and evaluate them
+        truncate(n_keep);
+        state->tokens.insert(state->tokens.end(), tokens.begin()+n_keep, tokens.end());
+        LM_ERROR_CATCH(grow_context(state->tokens.size()+n-1, n_keep), LM_BOOL_ERROR, {LM_RETHROW(fres);});
+        LM_ERROR_CATCH(evaluate_tokens(n_keep), LM_BOOL_ERROR, {LM_RETHROW(fres);});
+
+        // Predict tokens greedily
+        while (fres.size() != n) {
+            const int id = std::max_element(state->logits.begin(), state->logits.end()) - state->logits.begin();
+            fres.push_back(id);
+            // Last token doesn't need to be evaluated
+            if (fres.size() == n) break;
+            // Evaluate token
+            state->tokens.push_back(id);
+            const auto batch = llama_batch_get_one(&state->tokens.back(), 1, state->tokens.size()-1, state->seq_id);
+            if (llama_decode(state->ctx, batch)) {
+                state->tokens.pop_back();
+                LM_THROW("Failed to evaluate predicted tokens", fres);
+            }
+            store_logits();
+        }
+
         return fres;
     }
 
     unsigned get_context_size() const noexcept override {
         return get_state()->tokens.size();
     }
+    size_t get_memory_usage() const noexcept override {
+        auto& state = get_state();
+        // Context is shared between sequences, so each one accounts for its share of it
+        return llama_get_state_size(state->ctx) / params.n_seq_max + state->logits.size()*sizeof(float) + state->tokens.size()*sizeof(int);
+    }
 
     LM_ERRBOOL create_savestate(Savestate &sv) const LM_NOEXCEPTDECL override {
         auto& state = get_state();
-        sv.buf.resize(llama_get_state_size(state->ctx));
-        llama_copy_state_data(state->ctx, sv.buf.data());
+        if (!is_context_exclusive())
+            LM_THROW("Savestates are not available while multiple sequences share the context", LM_BOOL_ERROR);
+        // Context size is stored in front of state since state of differently sized contexts is incompatible
+        const uint32_t n_ctx = state->n_ctx;
+        sv.buf.resize(sizeof(n_ctx)+llama_get_state_size(state->ctx));
+        std::memcpy(sv.buf.data(), &n_ctx, sizeof(n_ctx));
+        llama_copy_state_data(state->ctx, sv.buf.data()+sizeof(n_ctx));
         sv.tokens = state->tokens;
         sv.prompt = state->prompt;
+        sv.prompt_marks = prompt_marks;
         sv.ctx = generic_state;
         return LM_BOOL_SUCCESS;
     }
     LM_ERRBOOL restore_savestate(const Savestate &sv) LM_NOEXCEPTDECL override {
         auto& state = get_state();
+        mark_modified();
         if (sv.ctx != generic_state)
             LM_THROW("Savestate does not match context", LM_BOOL_ERROR);
-        llama_set_state_data(state->ctx, const_cast<uint8_t*>(sv.buf.data()));
+        if (!is_context_exclusive())
+            LM_THROW("Savestates are not available while multiple sequences share the context", LM_BOOL_ERROR);
+        uint32_t n_ctx;
+        std::memcpy(&n_ctx, sv.buf.data(), sizeof(n_ctx));
+        if (n_ctx != state->n_ctx) {
+            LM_ERROR_FORWARD(resize_context(n_ctx), LM_BOOL_ERROR);
+        }
+        llama_set_state_data(state->ctx, const_cast<uint8_t*>(sv.buf.data()+sizeof(n_ctx)));
+        store_logits();
         state->tokens = sv.tokens;
         state->prompt = sv.prompt;
+        prompt_marks = sv.prompt_marks;
+        return LM_BOOL_SUCCESS;
+    }
+
+    LM_ERRBOOL reset() LM_NOEXCEPTDECL override {
+        auto& state = get_state();
+        reset_base();
+        state->tokens.clear();
+        state->prompt.clear();
+        state->logits.clear();
+        if (state->grammar) {
+            llama_grammar_free(state->grammar);
+            state->grammar = nullptr;
+        }
+        llama_kv_cache_seq_rm(state->ctx, state->seq_id, -1, -1);
+        // Shrink context back to its initial size if it has grown
+        const auto n_ctx_initial = state->context->lparams.n_ctx;
+        if (params.n_seq_max == 1 && state->n_ctx > n_ctx_initial) {
+            LM_ERROR_FORWARD(resize_context(n_ctx_initial), LM_BOOL_ERROR);
+        }
+        llama_set_rng_seed(state->ctx, params.seed);
         return LM_BOOL_SUCCESS;
     }
 
     LM_ERRBOOL serialize(std::ostream &o) const LM_NOEXCEPTDECL override {
         auto& state = get_state();
+        if (!is_context_exclusive())
+            LM_THROW("Serialization is not available while multiple sequences share the context", LM_BOOL_ERROR);
         // Get state size
         auto state_size = llama_get_state_size(state->ctx);
         // Write sizes
@@ -341,6 +764,9 @@ public:
     }
     LM_ERRBOOL deserialize(std::istream &i) LM_NOEXCEPTDECL override {
         auto& state = get_state();
+        mark_modified();
+        if (!is_context_exclusive())
+            LM_THROW("Deserialization is not available while multiple sequences share the context", LM_BOOL_ERROR);
         uint32_t n_ctx, embd_size, prompt_size, state_size;
         // Initialization to prevent compiler complaints
         n_ctx = embd_size = prompt_size = state_size = 0;
@@ -351,7 +777,11 @@ public:
             }
         }
         if (state->n_ctx != n_ctx) {
-            LM_THROW("Context length differs (My "+std::to_string(state->n_ctx)+" vs. files "+std::to_string(n_ctx)+')', LM_BOOL_ERROR);
+            // Context is resized to match if possible
+            if (n_ctx > params.n_ctx || params.n_seq_max != 1) {
+                LM_THROW("Context length differs (My "+std::to_string(state->n_ctx)+" vs. files "+std::to_string(n_ctx)+')', LM_BOOL_ERROR);
+            }
+            LM_ERROR_FORWARD(resize_context(n_ctx), LM_BOOL_ERROR);
         }
         // Read tokens
         state->tokens.resize(embd_size);
@@ -363,12 +793,15 @@ public:
         if (!i.read(state->prompt.data(), state->prompt.size())) {
             LM_THROW("Failed to deserialize prompt", LM_BOOL_ERROR);
         }
+        // Where text was added to the prompt isn't serialized
+        prompt_marks.clear();
         // Read state
         std::vector<uint8_t> state_buf(state_size);
         if (!i.read(reinterpret_cast<char*>(state_buf.data()), state_buf.size())) {
             LM_THROW("Failed to deserialize state", LM_BOOL_ERROR);
         }
         llama_set_state_data(state->ctx, state_buf.data());
+        store_logits();
         return LM_BOOL_SUCCESS;
     }
 
@@ -391,11 +824,407 @@ public:
         return LM_BOOL_SUCCESS;
     }
     LM_ERRBOOL unload_grammar() LM_NOEXCEPTDECL override {
-        get_state()->grammar = nullptr;
+        auto& state = get_state();
+        if (state->grammar) {
+            llama_grammar_free(state->grammar);
+            state->grammar = nullptr;
+        }
 
         return LM_BOOL_SUCCESS;
     }
 
+    Inference *create_sequence(const Params& p) LM_NOEXCEPTDECL override {
+        auto& state = get_state();
+        const auto seq_id = get_free_sequence();
+        if (seq_id < 0) {
+            LM_THROW("No free sequence left in context (see Params::n_seq_max)", nullptr);
+        }
+        // Parameters defining the context can't differ
+        auto seq_params = p;
+        seq_params.n_threads = params.n_threads;
+        seq_params.n_ctx = params.n_ctx;
+        seq_params.n_seq_max = params.n_seq_max;
+        seq_params.n_gpu_layers = params.n_gpu_layers;
+        seq_params.use_mmap = params.use_mmap;
+        seq_params.use_mlock = params.use_mlock;
+        // Create sequence
+        return new LLaMAInference(state->context, seq_id, seq_params);
+    }
+
+    // Branches are sequences of the same context that share the KV cache cells of what has been evaluated so far, so Params::n_seq_max limits their amount
+    Inference *fork() LM_NOEXCEPTDECL override {
+        auto& state = get_state();
+        const auto seq_id = get_free_sequence();
+        if (seq_id < 0) {
+            LM_THROW("No free sequence left in context for fork (see Params::n_seq_max)", nullptr);
+        }
+        auto fres = new LLaMAInference(state->context, seq_id, params);
+        auto& fork_state = fres->get_state();
+        llama_kv_cache_seq_cp(state->ctx, state->seq_id, seq_id, -1, -1);
+        state->shares_cells = fork_state->shares_cells = true;
+        fork_state->prompt = state->prompt;
+        fork_state->tokens = state->tokens;
+        fork_state->logits = state->logits;
+        fork_state->n_ctx = state->n_ctx;
+        fres->prompt_marks = prompt_marks;
+        if (state->grammar) {
+            fork_state->grammar = llama_grammar_copy(state->grammar);
+            fork_state->grammar_override_temp = state->grammar_override_temp;
+        }
+        fres->on_scroll = on_scroll;
+        fres->set_draft(draft, n_draft);
+        return fres;
+    }
+
+    std::vector<std::string> run_sequences(const std::vector<Inference*>& sequences, std::string_view end, const SequenceGenerateCallback &on_tick) LM_NOEXCEPTDECL override {
+        auto& state = get_state();
+
+        struct Run {
+            LLaMAInference *inference;
+            std::string fres;
+            size_t last_size = 0;
+            unsigned eos_count = 0;
+            bool abort = false;
+            bool done = false;
+            int batch_idx = -1;
+        };
+
+        // Collect sequences
+        std::vector<Run> runs;
+        runs.reserve(sequences.size());
+        for (auto sequence : sequences) {
+            auto inference = dynamic_cast<LLaMAInference*>(sequence);
+            if (!inference || inference->get_state()->context != state->context) {
+                LM_THROW("Sequence does not belong to this context", {});
+            }
+            for (const auto& run : runs) {
+                if (run.inference == inference) LM_THROW("Sequence was passed more than once", {});
+            }
+            runs.emplace_back().inference = inference;
+            inference->mark_modified();
+        }
+
+        // Loop until all sequences are done
+        Batch batch(runs.size());
+        for (;;) {
+            batch.clear();
+            for (auto& run : runs) {
+                if (run.done) continue;
+                auto& seq_state = run.inference->get_state();
+                run.batch_idx = -1;
+
+                // Check if end was reached
+                if (run.abort || (!end.empty() && run.fres.find(end) != run.fres.npos)) {
+                    run.done = true;
+                    continue;
+                }
+                run.last_size = run.fres.size();
+
+                // Sample top p and top k
+                int id;
+                try {
+                    id = run.inference->llama_sample_top_p_top_k();
+                } catch (const std::exception& e) {
+                    LM_THROW(e.what(), {});
+                }
+
+                if (id == llama_token_eos(seq_state->model)) {
+                    if (run.eos_count++ == run.inference->params.n_eos_ignores) {
+                        run.abort = run.done = true;
+                        continue;
+                    }
+                    seq_state->tokens.push_back(0);
+                    llama_tokenize(seq_state->model, "\n", 1, &seq_state->tokens.back(), 1, false, false);
+                    id = seq_state->tokens.back();
+                } else {
+                    // Add token
+                    seq_state->tokens.push_back(id);
+                }
+
+                // Get token as string
+                std::string str(14, ' ');
+                str.resize(llama_token_to_piece(seq_state->model, id, str.data(), 14));
+
+                // Append string to result
+                seq_state->prompt.append(str);
+                run.inference->mark_prompt_size(seq_state->tokens.size(), seq_state->prompt.size());
+                run.fres.append(str);
+
+                // Make sure token limit isn't hit, the new token is evaluated alongside the rest if scrolling was needed
+                if (!run.inference->window_scroll(seq_state->tokens.size()-1)) {
+                    // Queue token for evaluation
+                    run.batch_idx = batch.batch.n_tokens;
+                    batch.add(id, seq_state->tokens.size()-1, seq_state->seq_id, true);
+                }
+            }
+
+            // Stop if nothing is left to do
+            bool all_done = true;
+            for (const auto& run : runs) {
+                if (!run.done) all_done = false;
+            }
+            if (all_done) break;
+
+            // Evaluate new tokens of all sequences at once
+            if (batch.batch.n_tokens && llama_decode(state->ctx, batch.batch)) {
+                LM_THROW("Failed to evaluate new tokens", {});
+            }
+
+            // Tick
+            for (size_t idx = 0; idx != runs.size(); idx++) {
+                auto& run = runs[idx];
+                if (run.done) continue;
+                if (run.batch_idx >= 0) run.inference->store_logits(run.batch_idx);
+                if (on_tick && !on_tick(idx, run.fres.data()+run.last_size)) run.abort = true;
+            }
+        }
+
+        // Create final strings
+        std::vector<std::string> fres;
+        fres.reserve(runs.size());
+        for (auto& run : runs) {
+            if (!run.abort && run.fres.size() > end.size()) {
+                run.fres.resize(run.last_size);
+            }
+            fres.push_back(std::move(run.fres));
+        }
+
+        // Return final strings
+        return fres;
+    }
+
+    std::vector<std::string> run_n(unsigned n, std::string_view end, const SequenceGenerateCallback& on_tick) LM_NOEXCEPTDECL override {
+        auto& state = get_state();
+        const bool shares_cells = state->shares_cells;
+
+        // Fork off sequences sharing what has been evaluated so far
+        std::vector<std::unique_ptr<Inference>> branches;
+        std::vector<Inference*> sequences;
+        if (n != 0) sequences.push_back(this);
+        for (unsigned it = 1; it < n; it++) {
+            auto branch = fork();
+            if (!branch) return {};
+            branches.emplace_back(branch);
+            sequences.push_back(branch);
+        }
+
+        // Generate in lockstep, branches are dropped afterwards
+        auto fres = run_sequences(sequences, end, on_tick);
+        branches.clear();
+        state->shares_cells = shares_cells;
+        return fres;
+    }
+
+    std::vector<std::string> run_beam_search(unsigned n_beams, std::string_view end, float length_penalty, bool early_stopping) LM_NOEXCEPTDECL override {
+        auto& state = get_state();
+        mark_modified();
+        const auto n_vocab = llama_n_vocab(state->model);
+        const auto eos = llama_token_eos(state->model);
+        const size_t n_prompt = state->tokens.size();
+
+        if (n_beams == 0) {
+            LM_THROW("Beam search needs at least one beam", {});
+        }
+        if (state->logits.empty()) {
+            LM_THROW("Nothing has been evaluated to continue from yet", {});
+        }
+        if (state->grammar) {
+            LM_THROW("Beam search is not available while a grammar is loaded", {});
+        }
+
+        struct Beam {
+            llama_seq_id seq_id = -1;
+            size_t parent = 0; // Index of beam this one continues
+            std::vector<int> tokens; // Generated so far
+            std::string text;
+            size_t last_size = 0; // Size of text before last token was added
+            float logprob = 0.0f;
+            std::vector<std::pair<int, float>> candidates; // Most likely next tokens along with their log probabilities
+        };
+        struct Finished {
+            std::vector<int> tokens;
+            std::string text, result;
+            float score;
+        };
+        std::vector<Finished> finished;
+
+        // Returns the n_beams most likely tokens following given logits, most likely first
+        std::vector<int> ids(n_vocab);
+        auto get_candidates = [&] (const float *logits) {
+            const float max_logit = *std::max_element(logits, logits+n_vocab);
+            double sum = 0.0;
+            for (int id = 0; id != n_vocab; id++) sum += std::exp(logits[id]-max_logit);
+            const float log_sum = max_logit+float(std::log(sum));
+            const size_t n = std::min<size_t>(n_beams, n_vocab);
+            for (int id = 0; id != n_vocab; id++) ids[id] = id;
+            std::partial_sort(ids.begin(), ids.begin()+n, ids.end(), [logits] (int a, int b) {return logits[a] > logits[b];});
+            std::vector<std::pair<int, float>> fres;
+            fres.reserve(n);
+            for (size_t it = 0; it != n; it++) fres.emplace_back(ids[it], logits[ids[it]]-log_sum);
+            return fres;
+        };
+        auto get_score = [length_penalty] (float logprob, size_t n_tokens) {
+            return logprob / std::pow(float(std::max<size_t>(n_tokens, 1)), length_penalty);
+        };
+        auto finish = [&] (std::vector<int> tokens, std::string text, size_t result_size, float logprob) {
+            const auto n_tokens = tokens.size();
+            auto result = text.substr(0, result_size);
+            finished.push_back({std::move(tokens), std::move(text), std::move(result), get_score(logprob, n_tokens)});
+        };
+        auto rank_finished = [&] () {
+            std::stable_sort(finished.begin(), finished.end(), [] (const Finished& a, const Finished& b) {return a.score > b.score;});
+            if (finished.size() > n_beams) finished.resize(n_beams);
+        };
+
+        {
+            // Reserve a sequence for each beam besides the first one, which uses ours
+            // Beams share the KV cache cells of what they have in common, ours keeps the prompt
+            struct Reservation {
+                LLaMAInference& inference;
+                std::vector<llama_seq_id> seq_ids;
+                size_t n_prompt;
+                bool shares_cells;
+
+                ~Reservation() {
+                    auto& state = inference.get_state();
+                    for (const auto seq_id : seq_ids) {
+                        llama_kv_cache_seq_rm(state->ctx, seq_id, -1, -1);
+                        state->context->sequences[seq_id] = false;
+                    }
+                    llama_kv_cache_seq_rm(state->ctx, state->seq_id, n_prompt, -1);
+                    state->shares_cells = shares_cells;
+                }
+            } reservation{*this, {}, n_prompt, state->shares_cells};
+            auto& sequences = state->context->sequences;
+            for (llama_seq_id seq_id = 0; seq_id != llama_seq_id(sequences.size()) && reservation.seq_ids.size()+1 < n_beams; seq_id++) {
+                if (!sequences[seq_id]) reservation.seq_ids.push_back(seq_id);
+            }
+            if (reservation.seq_ids.size()+1 < n_beams) {
+                reservation.seq_ids.clear();
+                LM_THROW("Not enough free sequences left in context for beam search (see Params::n_seq_max)", {});
+            }
+            for (const auto seq_id : reservation.seq_ids) sequences[seq_id] = true;
+            state->shares_cells = true;
+            std::vector<llama_seq_id> free_seq_ids = reservation.seq_ids;
+            auto clear_sequence = [&] (llama_seq_id seq_id) {
+                llama_kv_cache_seq_rm(state->ctx, seq_id, seq_id == state->seq_id?llama_pos(n_prompt):-1, -1);
+            };
+            auto copy_sequence = [&] (llama_seq_id src, llama_seq_id dst) {
+                llama_kv_cache_seq_cp(state->ctx, src, dst, dst == state->seq_id?llama_pos(n_prompt):-1, -1);
+            };
+
+            // Start with a single beam continuing the prompt
+            std::vector<Beam> beams(1);
+            beams[0].seq_id = state->seq_id;
+            beams[0].candidates = get_candidates(state->logits.data());
+
+            Batch batch(n_beams);
+            while (!beams.empty()) {
+                // Finish all beams once there is no room for more tokens, they are all equally long
+                if (n_prompt+beams[0].tokens.size() >= state->n_ctx) {
+                    for (auto& beam : beams) finish(std::move(beam.tokens), beam.text, beam.text.size(), beam.logprob);
+                    break;
+                }
+
+                // Rank continuations of all beams
+                struct Candidate {
+                    size_t beam;
+                    int id;
+                    float logprob;
+                };
+                std::vector<Candidate> candidates;
+                for (size_t idx = 0; idx != beams.size(); idx++) {
+                    for (const auto& [id, logprob] : beams[idx].candidates) {
+                        candidates.push_back({idx, id, beams[idx].logprob+logprob});
+                    }
+                }
+                std::stable_sort(candidates.begin(), candidates.end(), [] (const Candidate& a, const Candidate& b) {return a.logprob > b.logprob;});
+
+                // Continue most likely ones, putting those that end aside
+                std::vector<Beam> next;
+                for (const auto& candidate : candidates) {
+                    if (next.size() == n_beams) break;
+                    const auto& parent = beams[candidate.beam];
+                    if (candidate.id == eos) {
+                        finish(parent.tokens, parent.text, parent.text.size(), candidate.logprob);
+                        continue;
+                    }
+                    auto& beam = next.emplace_back();
+                    beam.parent = candidate.beam;
+                    beam.tokens = parent.tokens;
+                    beam.tokens.push_back(candidate.id);
+                    std::string str(14, ' ');
+                    str.resize(llama_token_to_piece(state->model, candidate.id, str.data(), 14));
+                    beam.last_size = parent.text.size();
+                    beam.text = parent.text+str;
+                    beam.logprob = candidate.logprob;
+                    if (!end.empty() && beam.text.find(end) != beam.text.npos) {
+                        finish(std::move(beam.tokens), std::move(beam.text), beam.last_size, beam.logprob);
+                        next.pop_back();
+                    }
+                }
+
+                // Check if done
+                if (finished.size() >= n_beams) {
+                    if (early_stopping) break;
+                    // Beams only get less likely, so stop once the best one couldn't make it into the finished ones even if it ended now
+                    rank_finished();
+                    if (next.empty() || get_score(next.front().logprob, next.front().tokens.size()) <= finished.back().score) break;
+                }
+                if (next.empty()) break;
+
+                // First continuation of a beam takes over its sequence, others get a copy of it
+                std::vector<bool> taken(beams.size(), false);
+                for (const auto& beam : next) taken[beam.parent] = true;
+                for (size_t idx = 0; idx != beams.size(); idx++) {
+                    if (taken[idx]) continue;
+                    clear_sequence(beams[idx].seq_id);
+                    free_seq_ids.push_back(beams[idx].seq_id);
+                }
+                std::fill(taken.begin(), taken.end(), false);
+                for (auto& beam : next) {
+                    const auto parent_seq_id = beams[beam.parent].seq_id;
+                    if (!taken[beam.parent]) {
+                        taken[beam.parent] = true;
+                        beam.seq_id = parent_seq_id;
+                    } else {
+                        beam.seq_id = free_seq_ids.back();
+                        free_seq_ids.pop_back();
+                        copy_sequence(parent_seq_id, beam.seq_id);
+                    }
+                }
+
+                // Evaluate new tokens of all beams at once
+                batch.clear();
+                for (const auto& beam : next) {
+                    batch.add(beam.tokens.back(), n_prompt+beam.tokens.size()-1, beam.seq_id, true);
+                }
+                if (llama_decode(state->ctx, batch.batch)) {
+                    LM_THROW("Failed to evaluate new tokens", {});
+                }
+                for (size_t idx = 0; idx != next.size(); idx++) {
+                    next[idx].candidates = get_candidates(llama_get_logits_ith(state->ctx, idx));
+                }
+                beams = std::move(next);
+            }
+        }
+        rank_finished();
+        if (finished.empty()) return {};
+
+        // Continue context with best one, like run() would have
+        const auto& best = finished.front();
+        state->tokens.insert(state->tokens.end(), best.tokens.begin(), best.tokens.end());
+        state->prompt.append(best.text);
+        mark_prompt_size(state->tokens.size(), state->prompt.size());
+        LM_ERROR_CATCH(evaluate_tokens(n_prompt), LM_BOOL_ERROR, {LM_RETHROW({});});
+
+        // Return final strings
+        std::vector<std::string> fres;
+        fres.reserve(finished.size());
+        for (auto& f : finished) fres.push_back(std::move(f.result));
+        return fres;
+    }
+
     const std::string &get_prompt() const LM_NOEXCEPTDECL override {
         return get_state()->prompt;
     }
@@ -407,5 +1236,9 @@ public:
     bool is_grammar_available() const noexcept override {
         return true;
     }
+
+    bool is_multi_sequence_available() const noexcept override {
+        return true;
+    }
 };
 }
@@ -1,162 +1,773 @@
 #include "justlm_pool.hpp"
+#include "slot_codec.hpp"
 
 #include <filesystem>
 #include <fstream>
+#include <sstream>
 #include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
 
 
 
-bool LM::InferencePool::store_slot(Slot &slot) {
-    auto inference = slot.get_inference();
-    // Open output file
-    std::ofstream f(get_slot_filename(slot.get_id()), std::ios::binary);
+bool LM::InferencePool::write_slot_header(std::ostream& o, Slot& slot) {
     // Write weights path
     auto weights_path = slot.get_weights_path();
     uint32_t weights_path_len = weights_path.size();
-    f.write(reinterpret_cast<const char*>(&weights_path_len), sizeof(weights_path_len));
-    f.write(weights_path.data(), weights_path.size());
+    o.write(reinterpret_cast<const char*>(&weights_path_len), sizeof(weights_path_len));
+    o.write(weights_path.data(), weights_path.size());
     // Write params
-    if (!f.write(reinterpret_cast<const char*>(&inference->params), sizeof(inference->params))) {
+    return bool(o.write(reinterpret_cast<const char*>(&slot.get_inference()->params), sizeof(Inference::Params)));
+}
+
+bool LM::InferencePool::read_slot_header(std::istream& i, std::string& weights_path, Inference::Params& p) {
+    // Read weights path
+    uint32_t weights_path_len;
+    if (!i.read(reinterpret_cast<char*>(&weights_path_len), sizeof(weights_path_len))) {
+        return false;
+    }
+    weights_path.resize(weights_path_len);
+    if (!i.read(weights_path.data(), weights_path.size())) {
+        return false;
+    }
+    // Read params
+    return bool(i.read(reinterpret_cast<char*>(&p), sizeof(p)));
+}
+
+bool LM::InferencePool::is_slot_file_current(Slot& slot) {
+    auto inference = slot.get_inference();
+    std::error_code ec;
+    const auto file_size = std::filesystem::file_size(get_slot_filename(slot.get_id()), ec);
+    std::scoped_lock L(mutex);
+    auto res = slot_files.find(slot.get_id());
+    return !ec && res != slot_files.end() && res->second.size == file_size
+            && res->second.n_modifications == inference->get_modification_count()
+            && std::memcmp(res->second.params.data(), &inference->params, sizeof(Inference::Params)) == 0;
+}
+
+void LM::InferencePool::set_slot_file(Slot& slot, SlotFile file) {
+    auto inference = slot.get_inference();
+    file.n_modifications = inference->get_modification_count();
+    std::memcpy(file.params.data(), &inference->params, sizeof(Inference::Params));
+    std::scoped_lock L(mutex);
+    slot_files[slot.get_id()] = file;
+}
+
+bool LM::InferencePool::store_slot(Slot &slot) {
+    auto inference = slot.get_inference();
+    // Skip writing unmodified instances
+    if (is_slot_file_current(slot)) {
+        return true;
+    }
+    if (inference->is_delta_serialization_available()) {
+        return store_slot_delta(slot);
+    }
+    {
+        // File is unknown until it has been written
+        std::scoped_lock L(mutex);
+        slot_files.erase(slot.get_id());
+    }
+    // Open output file, compressing its content if requested
+    const auto filename = get_slot_filename(slot.get_id());
+    std::ofstream f(filename, std::ios::binary);
+    std::optional<SlotCodec::CompressingStreambuf> compressor;
+    std::ostream o(f.rdbuf());
+    if (compress_slots) {
+        compressor.emplace(f);
+        o.rdbuf(&*compressor);
+    }
+    // Write weights path and params
+    if (!write_slot_header(o, slot)) {
         return false;
     }
     // Serialize instance
     try {
-        inference->serialize(f);
+        inference->serialize(o);
     } catch (...) {
         return false;
     }
+    // Write remaining compressed data
+    if (compressor && !compressor->finish()) {
+        return false;
+    }
+    if (!o || !f.flush()) {
+        return false;
+    }
+    // Remember file
+    SlotFile file;
+    file.size = file.base_size = f.tellp();
+    set_slot_file(slot, file);
     // Return success
     return true;
 }
 
-LM::InferencePool::Slot *LM::InferencePool::load_slot(size_t id, Slot *suggested_slot) {
+bool LM::InferencePool::store_slot_delta(Slot &slot) {
+    auto inference = slot.get_inference();
+    const auto id = slot.get_id();
+    const auto filename = get_slot_filename(id);
+    // Append to file unless it's missing, has been changed by something else or consists of deltas mostly
+    std::error_code ec;
+    const auto file_size = std::filesystem::file_size(filename, ec);
+    SlotFile file;
+    bool append;
+    {
+        std::scoped_lock L(mutex);
+        auto res = slot_files.find(id);
+        append = !ec && res != slot_files.end() && res->second.deltas && res->second.size == file_size && res->second.delta_size < res->second.base_size;
+        if (append) file = res->second;
+        // File is unknown until record has been written
+        slot_files.erase(id);
+    }
+    // Write record into memory, compressing it if requested
+    std::ostringstream record;
+    {
+        std::optional<SlotCodec::CompressingStreambuf> compressor;
+        std::ostream o(record.rdbuf());
+        if (compress_slots) {
+            compressor.emplace(record);
+            o.rdbuf(&*compressor);
+        }
+        if (!write_slot_header(o, slot)) {
+            return false;
+        }
+        try {
+            inference->serialize_delta(o, !append);
+        } catch (...) {
+            return false;
+        }
+        if ((compressor && !compressor->finish()) || !o) {
+            return false;
+        }
+    }
+    const auto data = record.str();
+    // Write record, starting a new file unless appending
+    std::ofstream f(filename, std::ios::binary | (append?std::ios::app:std::ios::trunc));
+    if (!append) f.write(delta_magic, sizeof(delta_magic));
+    const uint64_t record_size = data.size();
+    f.write(reinterpret_cast<const char*>(&record_size), sizeof(record_size));
+    f.write(data.data(), data.size());
+    if (!f.flush()) {
+        return false;
+    }
+    // Remember file
+    if (append) {
+        file.size += sizeof(record_size) + data.size();
+        file.delta_size += data.size();
+    } else {
+        file.size = sizeof(delta_magic) + sizeof(record_size) + data.size();
+        file.base_size = data.size();
+        file.delta_size = 0;
+        file.deltas = true;
+    }
+    set_slot_file(slot, file);
+    return true;
+}
+
+std::shared_ptr<LM::Inference> LM::InferencePool::recycle_inference(Slot& slot, const std::string& weights_path, const Inference::Params& p) {
+    std::shared_ptr<Inference> inference;
+    {
+        std::scoped_lock L(mutex);
+        for (auto it = spares.rbegin(); it != spares.rend(); it++) {
+            if (it->weights_path == weights_path && it->inference->params.is_compatible(p)) {
+                inference = std::move(it->inference);
+                spares.erase(std::next(it).base());
+                break;
+            }
+        }
+    }
+    if (!inference) return slot.create_inference(weights_path, p);
+    inference->params = p;
+    slot.set_inference(weights_path, inference);
+    return inference;
+}
+
+bool LM::InferencePool::load_slot(size_t id, Slot& slot) {
     // Open input file
     std::ifstream f(get_slot_filename(id), std::ios::binary);
     if (!f) {
         // Does not exist
-        return nullptr;
+        return false;
     }
-    // Read weights path
+    // Decompress whole file if it's compressed
+    std::vector<char> decompressed;
+    std::optional<SlotCodec::MemoryStreambuf> decompressed_buf;
+    std::istream i(f.rdbuf());
+    char magic[sizeof(SlotCodec::magic)];
+    if (f.read(magic, sizeof(magic)) && std::equal(magic, magic+sizeof(magic), delta_magic)) {
+        return load_slot_delta(f, slot);
+    } else if (f && std::equal(magic, magic+sizeof(magic), SlotCodec::magic)) {
+        if (!SlotCodec::decompress_stream(f, decompressed, std::thread::hardware_concurrency())) {
+            return false;
+        }
+        decompressed_buf.emplace(decompressed.data(), decompressed.size());
+        i.rdbuf(&*decompressed_buf);
+    } else {
+        f.clear();
+        f.seekg(0);
+    }
+    // Read weights path and params
     std::string weights_path;
-    uint32_t weights_path_len;
-    if (!f.read(reinterpret_cast<char*>(&weights_path_len), sizeof(weights_path_len))) {
-        return nullptr;
+    LM::Inference::Params p;
+    if (!read_slot_header(i, weights_path, p)) {
+        return false;
     }
-    weights_path.resize(weights_path_len);
-    if (!f.read(weights_path.data(), weights_path.size())) {
-        return nullptr;
+    // Create and deserialize instance
+    try {
+        auto inference = recycle_inference(slot, weights_path, p);
+        if (!inference) return false;
+        inference->deserialize(i);
+    } catch (...) {
+        return false;
     }
-    // Read params
-    LM::Inference::Params p;
-    if (!f.read(reinterpret_cast<char*>(&p), sizeof(p))) {
-        return nullptr;
+    // Remember file, so it doesn't need to be written again unless the instance is modified
+    SlotFile file;
+    std::error_code ec;
+    file.size = file.base_size = std::filesystem::file_size(get_slot_filename(id), ec);
+    if (!ec) set_slot_file(slot, file);
+    // Return success
+    return true;
+}
+
+bool LM::InferencePool::load_slot_delta(std::istream& f, Slot& slot) {
+    // Get file size
+    f.seekg(0, std::ios::end);
+    const size_t file_size = f.tellg();
+    f.seekg(sizeof(delta_magic));
+    // Read records, decompressing them if needed
+    // A torn last record, as left behind if appending was interrupted, is ignored
+    std::vector<std::vector<char>> records;
+    SlotFile file;
+    file.size = sizeof(delta_magic);
+    for (;;) {
+        uint64_t record_size;
+        if (!f.read(reinterpret_cast<char*>(&record_size), sizeof(record_size))) break;
+        if (record_size > file_size - file.size - sizeof(record_size)) break;
+        std::vector<char> record(record_size);
+        if (!f.read(record.data(), record.size())) break;
+        (records.empty()?file.base_size:file.delta_size) += record.size();
+        file.size += sizeof(record_size) + record.size();
+        if (record.size() >= sizeof(SlotCodec::magic) && std::equal(SlotCodec::magic, SlotCodec::magic+sizeof(SlotCodec::magic), record.data())) {
+            SlotCodec::MemoryStreambuf compressed(record.data()+sizeof(SlotCodec::magic), record.size()-sizeof(SlotCodec::magic));
+            std::istream i(&compressed);
+            std::vector<char> decompressed;
+            if (!SlotCodec::decompress_stream(i, decompressed, std::thread::hardware_concurrency())) {
+                return false;
+            }
+            record = std::move(decompressed);
+        }
+        records.push_back(std::move(record));
+    }
+    if (records.empty()) {
+        return false;
     }
-    // Create instance
-    auto& slot = suggested_slot?*suggested_slot:*(get_free_slot());
-    auto inference = slot.create_inference(id, weights_path, p);
-    // Deserialize instance
     try {
-        inference->deserialize(f);
+        // Create instance from most recent weights path and params
+        std::string weights_path;
+        LM::Inference::Params p;
+        {
+            SlotCodec::MemoryStreambuf record(records.back().data(), records.back().size());
+            std::istream i(&record);
+            if (!read_slot_header(i, weights_path, p)) {
+                return false;
+            }
+        }
+        auto inference = recycle_inference(slot, weights_path, p);
+        if (!inference) return false;
+        // Apply all records in order
+        for (auto& data : records) {
+            SlotCodec::MemoryStreambuf record(data.data(), data.size());
+            std::istream i(&record);
+            if (!read_slot_header(i, weights_path, p)) {
+                return false;
+            }
+            inference->deserialize_delta(i);
+        }
     } catch (...) {
-        slot.reset();
-        return nullptr;
+        return false;
     }
-    // Return final slot
-    return &slot;
+    // Remember file so further deltas can be appended to it
+    file.deltas = true;
+    set_slot_file(slot, file);
+    return true;
 }
 
-LM::InferencePool::Slot *LM::InferencePool::get_free_slot() {
-    // Attempt to find free slot while finding oldest one
-    Slot *oldest = nullptr;
-    for (auto& slot : slots) {
-        // Take free slot
-        if (slot.is_free()) {
-            return &slot;
+void LM::InferencePool::run_io_thread() {
+    std::unique_lock L(mutex);
+    for (;;) {
+        write_queue_cv.wait(L, [this] () {return stopping || !write_queue.empty();});
+        // Only stop once everything has been written
+        if (write_queue.empty()) break;
+        auto& slot = *write_queue.front();
+        write_queue.pop_front();
+        // Skip slots that have been taken back or reused since
+        if (slot.get_state() != SlotState::evicted) continue;
+        // Write slot without holding the lock, nobody else touches it meanwhile
+        slot.set_state(SlotState::writing);
+        L.unlock();
+        const bool ok = store_slot(slot);
+        L.lock();
+        auto spare = finish_write(slot, ok);
+        if (!spare.inference) make_room(L, 0, 0, &slot);
+        slot_cv.notify_all();
+        // Keep freed instance as a spare unless it is still referenced elsewhere
+        if (spare.inference && spare.inference.use_count() == 1 && max_spares != 0 && !stopping) {
+            L.unlock();
+            LM_ERROR_CATCH(spare.inference->reset(), LM_BOOL_ERROR, {
+                spare.inference = nullptr;
+            });
+            L.lock();
+            if (spare.inference) {
+                spares.push_back(std::move(spare));
+                while (spares.size() > max_spares) spares.pop_front();
+            }
         }
-        // Update oldest
-        if (oldest == nullptr || slot.get_last_access() < oldest->get_last_access()) {
-            oldest = &slot;
+    }
+}
+
+bool LM::InferencePool::wait(std::unique_lock<std::mutex>& L, const Deadline& deadline) {
+    if (!deadline) {
+        slot_cv.wait(L);
+        return true;
+    }
+    return slot_cv.wait_until(L, *deadline) != std::cv_status::timeout;
+}
+
+std::shared_ptr<LM::Inference> LM::InferencePool::get_held_inference(Slot& slot) {
+    auto inference = slot.get_inference();
+    std::weak_ptr<char> pool_alive = alive;
+    // Returned pointer keeps a reference to the instance itself, so it can't be recycled until the hold has been released
+    return std::shared_ptr<Inference>(inference.get(), [this, &slot, inference, pool_alive] (Inference *) {
+        if (!pool_alive.expired()) release_hold(slot, inference);
+    });
+}
+
+void LM::InferencePool::release_hold(Slot& slot, const std::shared_ptr<Inference>& inference) {
+    std::unique_lock L(mutex);
+    // Slot may have been freed or reused meanwhile, instances of loading slots are set without holding the lock
+    if (slot.get_state() != SlotState::live || slot.get_inference() != inference || slot.n_holders == 0) return;
+    slot.n_holders--;
+    update_stats(slot, false);
+    // Instance may have grown beyond memory budget or pool size while held
+    make_room(L);
+    slot_cv.notify_all();
+}
+
+void LM::InferencePool::update_stats(Slot& slot, bool count_access) {
+    auto& s = stats[slot.get_id()];
+    s.id = slot.get_id();
+    s.last_access = std::chrono::system_clock::now();
+    if (!slot.is_in_use()) s.memory_usage = slot.get_inference()->get_memory_usage();
+    if (count_access) s.n_accesses++;
+}
+
+void LM::InferencePool::report_write_error(const Slot& slot) {
+    fprintf(stderr, "InferencePool: failed to write instance %zu of pool %s to disk, keeping it in memory\n", slot.get_id(), pool_name.c_str());
+    n_failed_writes++;
+}
+
+LM::InferencePool::Spare LM::InferencePool::finish_write(Slot& slot, bool ok) {
+    // Keep instance rather than losing it, writing it is tried again once it is evicted again
+    if (!ok) report_write_error(slot);
+    if (!ok || slot.wanted) {
+        slot.wanted = false;
+        slot.set_state(SlotState::live);
+        update_stats(slot, false);
+        return {};
+    }
+    Spare fres{std::string(slot.get_weights_path()), slot.get_inference()};
+    free_slot(slot);
+    return fres;
+}
+
+bool LM::InferencePool::make_room(std::unique_lock<std::mutex>&, size_t keep_free, size_t keep_bytes, const Slot *keep) {
+    for (;;) {
+        // Count instances and memory that are or will be live while finding the one the policy suggests evicting first
+        size_t n_live = 0,
+               n_bytes = 0;
+        Slot *victim = nullptr;
+        for (auto& slot : slots) {
+            const auto state = slot.get_state();
+            if (state != SlotState::live && state != SlotState::loading) continue;
+            const auto& s = stats[slot.get_id()];
+            if (slot.n_holders == 0) n_live++;
+            n_bytes += s.memory_usage;
+            if (state != SlotState::live || slot.is_in_use() || &slot == keep || pinned.find(slot.get_id()) != pinned.end()) continue;
+            if (victim == nullptr || policy->evict_before(s, stats[victim->get_id()])) {
+                victim = &slot;
+            }
         }
+        // Stop once there is enough room or nothing left to evict
+        const bool over_size = n_live + keep_free > size;
+        if (!over_size && (memory_budget == 0 || n_bytes + keep_bytes <= memory_budget)) return true;
+        if (!victim) return !over_size;
+        // Queue slot for being written to disk
+        victim->set_state(SlotState::evicted);
+        write_queue.push_back(victim);
+        write_queue_cv.notify_one();
     }
-    // Free up oldest slot and take that one
-    // Note: Since there has to be at least 1 slot, oldest is never going to be a nullptr
-    store_and_reset_slot(*oldest);
-    return oldest;
 }
 
-LM::InferencePool::Slot *LM::InferencePool::find_slot_by_id(size_t id, bool deserialize) {
-    // Attempt to find given slot while finding oldest one
-    Slot *oldest = nullptr;
+LM::InferencePool::Slot *LM::InferencePool::reserve_slot(std::unique_lock<std::mutex>& L, size_t id) {
+    // All live instances may be leased or pinned, memory usage of instance is assumed to be the same as last time
+    if (!make_room(L, 1, stats[id].memory_usage)) return nullptr;
+    // Take free slot, all extra slots may hold instances that have yet to be written
+    Slot *fres = nullptr;
+    size_t n_held = 0;
     for (auto& slot : slots) {
-        // Take slot with ID
-        if (slot.get_id() == id) {
-            return &slot;
-        }
-        // Update oldest
-        if (oldest == nullptr || slot.get_last_access() < oldest->get_last_access()) {
-            oldest = &slot;
-        }
-    }
-    // Slot not found, attempt to load it
-    if (deserialize) {
-        if (!oldest->is_free()) store_slot(*oldest);
-        if (!load_slot(id, oldest)) {
-            // In case slot loading failed, still reset slot for later use
-            //TODO: Make this configurable
-            oldest->reset();
+        if (slot.is_free()) {
+            fres = &slot;
+            break;
+        }
+        if (slot.n_holders != 0) n_held++;
+    }
+    // Held instances don't count against the pool size, so add a slot if they occupy the ones left
+    if (!fres && slots.size() < size + max_pending_writes + n_held) {
+        fres = &slots.emplace_back();
+    }
+    if (!fres) return nullptr;
+    fres->set_id(id);
+    fres->set_state(SlotState::loading);
+    index[id] = fres;
+    return fres;
+}
+
+void LM::InferencePool::free_slot(Slot& slot) {
+    auto res = index.find(slot.get_id());
+    if (res != index.end() && res->second == &slot) index.erase(res);
+    slot.reset();
+}
+
+void LM::InferencePool::release_slot(Slot& slot) {
+    std::unique_lock L(mutex);
+    slot.leased = false;
+    update_stats(slot, false);
+    // Instance may have grown beyond memory budget while leased
+    make_room(L);
+    slot_cv.notify_all();
+}
+
+void LM::InferencePool::Lease::release() {
+    if (!pool) return;
+    inference = nullptr;
+    pool->release_slot(*slot);
+    pool = nullptr;
+    slot = nullptr;
+}
+
+LM::InferencePool::Slot *LM::InferencePool::find_slot_by_id(std::unique_lock<std::mutex>& L, size_t id, bool deserialize, bool lease, const Deadline& deadline) {
+    for (;;) {
+        // Attempt to find given slot
+        auto res = index.find(id);
+        if (res != index.end()) {
+            auto& slot = *res->second;
+            switch (slot.get_state()) {
+            case SlotState::live: {
+                if (!lease || !slot.leased) {
+                    slot.acquire(lease);
+                    return &slot;
+                }
+                // Wait for current lease to be released
+            } break;
+            case SlotState::evicted: {
+                // Take instance back before it has been written
+                slot.set_state(SlotState::live);
+                slot.acquire(lease);
+                make_room(L, 0, 0, &slot);
+                return &slot;
+            }
+            case SlotState::writing: {
+                // Instance is kept once it has been written
+                slot.wanted = true;
+            } break;
+            default: {
+                // Wait for instance to be loaded
+            } break;
+            }
+            // Wait for slot to change and look again
+            if (!wait(L, deadline)) return nullptr;
+            continue;
+        }
+        // Slot not found, attempt to load it
+        if (!deserialize) return nullptr;
+        auto slot = reserve_slot(L, id);
+        if (!slot) {
+            // Wait for room and look again, someone else may load the instance meanwhile
+            if (!wait(L, deadline)) return nullptr;
+            continue;
+        }
+        L.unlock();
+        const auto load_start = std::chrono::steady_clock::now();
+        const bool ok = load_slot(id, *slot);
+        const auto load_time = std::chrono::steady_clock::now() - load_start;
+        L.lock();
+        // In case slot loading failed, still reset slot for later use
+        //TODO: Make this configurable
+        if (ok) {
+            slot->set_state(SlotState::live);
+            stats[id].load_time = std::chrono::duration_cast<std::chrono::milliseconds>(load_time);
+            update_stats(*slot, false);
+            slot->acquire(lease);
+            // Actual memory usage is only known now
+            make_room(L, 0, 0, slot);
         } else {
-            return oldest;
+            free_slot(*slot);
+        }
+        slot_cv.notify_all();
+        return ok?slot:nullptr;
+    }
+}
+
+LM::InferencePool::Slot *LM::InferencePool::create_inference(std::unique_lock<std::mutex>& L, size_t id, const std::string& weights_path, const Inference::Params& p, bool lease, const Deadline& deadline) {
+    Slot *slot;
+    for (;;) {
+        // Replace existing instance
+        if (index.find(id) != index.end()) {
+            auto existing = find_slot_by_id(L, id, false, true, deadline);
+            if (existing) {
+                free_slot(*existing);
+                slot_cv.notify_all();
+            } else if (index.find(id) != index.end()) {
+                // Timed out waiting for existing instance
+                return nullptr;
+            }
         }
+        // Get slot, waiting for room if needed
+        slot = reserve_slot(L, id);
+        if (slot) break;
+        if (!wait(L, deadline)) return nullptr;
+    }
+    // Deltas of the new instance can't be appended to the file of the old one
+    slot_files.erase(id);
+    // Create instance without holding the lock
+    auto params = p;
+    params.quantize_serialized_kv |= quantize_slot_kv;
+    L.unlock();
+    const auto load_start = std::chrono::steady_clock::now();
+    std::shared_ptr<Inference> inference;
+    try {
+        inference = slot->create_inference(weights_path, params);
+    } catch (...) {
+        L.lock();
+        free_slot(*slot);
+        slot_cv.notify_all();
+        throw;
+    }
+    const auto load_time = std::chrono::steady_clock::now() - load_start;
+    L.lock();
+    if (inference) {
+        slot->set_state(SlotState::live);
+        // Previous statistics belong to the replaced instance
+        auto& s = stats[id];
+        s = {};
+        s.load_time = std::chrono::duration_cast<std::chrono::milliseconds>(load_time);
+        update_stats(*slot, false);
+        slot->acquire(lease);
+        make_room(L, 0, 0, slot);
+    } else {
+        free_slot(*slot);
+        slot = nullptr;
+    }
+    slot_cv.notify_all();
+    return slot;
+}
+
+LM::InferencePool::InferencePool(size_t size, const std::string& pool_name, bool clean_up, size_t max_pending_writes)
+        : size(size), max_pending_writes(max_pending_writes), pool_name(pool_name) {
+    // Make sure size isn't zero
+    if (this->size == 0) this->size = 1;
+    // Create slots as requested, extra ones for instances pending to be written
+    slots.resize(this->size+max_pending_writes);
+    // Clean up previous slots as requested
+    if (clean_up) {
+        cleanup();
+    }
+    // Start I/O thread
+    io_thread = std::thread([this] () {run_io_thread();});
+}
+
+LM::InferencePool::~InferencePool() {
+    // Let I/O thread complete pending writes
+    {
+        std::scoped_lock L(mutex);
+        stopping = true;
     }
-    // Slot not found
-    return nullptr;
+    write_queue_cv.notify_one();
+    io_thread.join();
+}
+
+LM::InferencePool::Lease LM::InferencePool::lease_inference(size_t id, std::optional<std::chrono::milliseconds> timeout) {
+    std::unique_lock L(mutex);
+    auto slot = find_slot_by_id(L, id, true, true, get_deadline(timeout));
+    if (slot) {
+        update_stats(*slot, true);
+        return Lease(this, slot);
+    }
+    return {};
+}
+
+LM::InferencePool::Lease LM::InferencePool::lease_or_create_inference(size_t id, const std::string &weights_path, const Inference::Params &p, std::optional<std::chrono::milliseconds> timeout) {
+    const auto deadline = get_deadline(timeout);
+    std::unique_lock L(mutex);
+    auto slot = find_slot_by_id(L, id, true, true, deadline);
+    if (!slot && index.find(id) == index.end()) {
+        slot = create_inference(L, id, weights_path, p, true, deadline);
+    }
+    if (slot) {
+        update_stats(*slot, true);
+        return Lease(this, slot);
+    }
+    return {};
+}
+
+std::shared_ptr<LM::Inference> LM::InferencePool::create_inference(size_t id, const std::string &weights_path, const Inference::Params &p) {
+    std::unique_lock L(mutex);
+    auto slot = create_inference(L, id, weights_path, p);
+    if (slot) {
+        update_stats(*slot, true);
+        return get_held_inference(*slot);
+    }
+    return {};
 }
 
 std::shared_ptr<LM::Inference> LM::InferencePool::get_inference(size_t id) {
-    auto slot = find_slot_by_id(id);
+    std::unique_lock L(mutex);
+    auto slot = find_slot_by_id(L, id, true);
     if (slot) {
-        return slot->get_inference(true);
+        update_stats(*slot, true);
+        return get_held_inference(*slot);
     }
     return {};
 }
 
+std::future<std::shared_ptr<LM::Inference>> LM::InferencePool::get_inference_async(size_t id) {
+    return std::async(std::launch::async, [this, id] () {
+        return get_inference(id);
+    });
+}
+
 std::shared_ptr<LM::Inference> LM::InferencePool::get_or_create_inference(size_t id, const std::string &weights_path, const Inference::Params &p) {
-    auto slot = find_slot_by_id(id);
+    std::unique_lock L(mutex);
+    auto slot = find_slot_by_id(L, id, true);
+    if (!slot) {
+        slot = create_inference(L, id, weights_path, p);
+    }
     if (slot) {
-        return slot->get_inference(true);
+        update_stats(*slot, true);
+        return get_held_inference(*slot);
     }
-    slot = get_free_slot();
-    return slot->create_inference(id, weights_path, p);
+    return {};
 }
 
 void LM::InferencePool::delete_inference(size_t id) {
-    auto slot = find_slot_by_id(id, false);
+    std::unique_lock L(mutex);
+    auto slot = find_slot_by_id(L, id, false, true);
     // Reset slot
     if (slot) {
-        slot->reset();
+        free_slot(*slot);
+        slot_cv.notify_all();
     }
+    stats.erase(id);
+    pinned.erase(id);
+    slot_files.erase(id);
     // Delete file
     std::error_code ec;
     std::filesystem::remove(get_slot_filename(id), ec);
 }
 
 void LM::InferencePool::store_all() {
-    for (auto& slot : slots) {
-        if (slot.is_free()) continue;
-        store_slot(slot);
+    std::unique_lock L(mutex);
+    // Wait for evicted slots to be written
+    slot_cv.wait(L, [this] () {
+        for (const auto& slot : slots) {
+            const auto state = slot.get_state();
+            if (state == SlotState::evicted || state == SlotState::writing || state == SlotState::loading) return false;
+        }
+        return true;
+    });
+    // Write live slots, leasing them meanwhile
+    std::vector<size_t> ids;
+    for (const auto& [id, slot] : index) {
+        if (slot->get_state() == SlotState::live) ids.push_back(id);
+    }
+    for (const auto id : ids) {
+        auto slot = find_slot_by_id(L, id, false, true);
+        if (!slot) continue;
+        L.unlock();
+        const bool ok = store_slot(*slot);
+        L.lock();
+        if (!ok) report_write_error(*slot);
+        slot->leased = false;
+        slot_cv.notify_all();
     }
     return;
 }
 
-std::vector<size_t> LM::InferencePool::get_active_slot_ids() const {
+std::vector<size_t> LM::InferencePool::get_active_slot_ids() {
+    std::scoped_lock L(mutex);
     std::vector<size_t> fres;
-    for (const auto& slot : slots) {
-        fres.push_back(slot.get_id());
+    for (const auto& [id, slot] : index) {
+        if (slot->get_state() != SlotState::live) continue;
+        fres.push_back(id);
+    }
+    return fres;
+}
+
+void LM::InferencePool::set_memory_budget(size_t bytes) {
+    std::unique_lock L(mutex);
+    memory_budget = bytes;
+    make_room(L);
+}
+
+size_t LM::InferencePool::get_failed_write_count() {
+    std::scoped_lock L(mutex);
+    return n_failed_writes;
+}
+
+size_t LM::InferencePool::get_memory_usage() {
+    std::scoped_lock L(mutex);
+    size_t fres = 0;
+    for (const auto& [id, slot] : index) {
+        if (slot->get_state() != SlotState::live) continue;
+        fres += stats[id].memory_usage;
     }
     return fres;
 }
 
+void LM::InferencePool::set_eviction_policy(std::unique_ptr<EvictionPolicy> policy) {
+    std::scoped_lock L(mutex);
+    this->policy = std::move(policy);
+}
+
+void LM::InferencePool::set_pinned(size_t id, bool pinned) {
+    std::unique_lock L(mutex);
+    if (pinned) {
+        this->pinned.insert(id);
+    } else {
+        this->pinned.erase(id);
+        // Instance may have been kept above memory budget
+        make_room(L);
+    }
+    slot_cv.notify_all();
+}
+
+void LM::InferencePool::set_slot_compression(bool compress, bool quantize_kv) {
+    std::scoped_lock L(mutex);
+    compress_slots = compress;
+    quantize_slot_kv = quantize_kv;
+}
+
+void LM::InferencePool::set_max_spare_instances(size_t n) {
+    std::scoped_lock L(mutex);
+    max_spares = n;
+    while (spares.size() > max_spares) spares.pop_front();
+}
+
 void LM::InferencePool::cleanup() {
+    {
+        std::scoped_lock L(mutex);
+        slot_files.clear();
+    }
     // Collect files
     const auto prefix = get_slot_filename_prefix();
     for (auto& file : std::filesystem::directory_iterator(".")) {
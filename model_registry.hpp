@@ -0,0 +1,74 @@
+#ifndef MODEL_REGISTRY_HPP
+#define MODEL_REGISTRY_HPP
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <future>
+
+
+
+// Process-wide registry of loaded models, so that all instances using the same weights share them
+template<typename Model>
+class ModelRegistry {
+    struct Entry {
+        std::weak_ptr<Model> model;
+        std::shared_future<std::shared_ptr<Model>> pending; // Valid while model is being loaded
+    };
+
+    std::mutex mutex;
+    std::map<std::string, Entry> models;
+
+public:
+    static ModelRegistry& get_instance() {
+        static ModelRegistry instance;
+        return instance;
+    }
+
+    // The key must contain everything that affects loading (weights path, relevant parameters)
+    // Calls given loader if model isn't loaded yet, returns nullptr if that one does
+    // The registry isn't locked while loading, others asking for the same model meanwhile wait for that load instead
+    std::shared_ptr<Model> get(const std::string& key, const std::function<std::shared_ptr<Model> ()>& loader) {
+        std::unique_lock L(mutex);
+        // Drop models that have been freed in the meantime
+        for (auto it = models.begin(); it != models.end();) {
+            if (!it->second.pending.valid() && it->second.model.expired()) it = models.erase(it);
+            else it++;
+        }
+        // Look up model
+        auto& entry = models[key];
+        if (auto fres = entry.model.lock()) return fres;
+        if (entry.pending.valid()) {
+            auto pending = entry.pending;
+            L.unlock();
+            return pending.get();
+        }
+        // Load model
+        std::promise<std::shared_ptr<Model>> promise;
+        entry.pending = promise.get_future().share();
+        L.unlock();
+        std::shared_ptr<Model> fres;
+        try {
+            fres = loader();
+        } catch (...) {
+            L.lock();
+            models.erase(key);
+            L.unlock();
+            promise.set_exception(std::current_exception());
+            throw;
+        }
+        L.lock();
+        if (fres) {
+            // Entries being loaded are never dropped by others, so entry is still valid
+            entry.model = fres;
+            entry.pending = {};
+        } else {
+            models.erase(key);
+        }
+        L.unlock();
+        promise.set_value(fres);
+        return fres;
+    }
+};
+#endif // MODEL_REGISTRY_HPP
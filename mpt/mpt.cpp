@@ -1,6 +1,7 @@
 #include "mpt.hpp"
 #include "../g4a_common.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstdio>
@@ -23,11 +24,12 @@ unsigned long long operator ""_MiB(unsigned long long bytes) {
     return bytes*1024*1024;
 }
 
-static bool kv_cache_init(
+bool mpt_kv_cache_init(
         const struct mpt_hparams & hparams,
              struct mpt_kv_cache & cache,
                          ggml_type   wtype,
-                               int   n_ctx) {
+                               int   n_ctx,
+                               int   n_ctx_max) {
     const int n_embd  = hparams.n_embd;
     const int n_layer = hparams.n_layer;
 
@@ -51,11 +53,93 @@ static bool kv_cache_init(
     cache.k = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
     cache.v = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
 
+    cache.n         = 0;
+    cache.n_saved   = 0;
+    cache.n_ctx     = n_ctx;
+    cache.n_ctx_max = std::max(n_ctx, n_ctx_max);
+
+    return true;
+}
+
+// Removes tokens in range [p0, p1) from the cache, moving all tokens following them into their place
+void mpt_kv_cache_erase(const mpt_hparams & hparams, mpt_kv_cache & cache, int p0, int p1) {
+    const int n_embd  = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
+    const int n_ctx   = cache.n_ctx;
+
+    // Only tokens actually in the cache need to be moved
+    p1 = std::min(p1, cache.n);
+    if (p0 >= p1) return;
+    const int n_move = cache.n - p1;
+    const size_t row_size = ggml_element_size(cache.k)*n_embd;
+    const size_t v_size = ggml_element_size(cache.v);
+
+    for (int il = 0; il < n_layer; il++) {
+        // Move rows of kept tokens into place
+        auto layer = reinterpret_cast<uint8_t*>(cache.k->data) + size_t(il)*n_ctx*row_size;
+        memmove(layer + p0*row_size, layer + p1*row_size, n_move*row_size);
+        // V is transposed, so kept tokens need to be moved in every dimension
+        for (int dim = 0; dim < n_embd; dim++) {
+            auto row = reinterpret_cast<uint8_t*>(cache.v->data) + size_t(il*n_embd + dim)*n_ctx*v_size;
+            memmove(row + p0*v_size, row + p1*v_size, n_move*v_size);
+        }
+    }
+
+    cache.n -= p1 - p0;
+    cache.n_saved = std::min(cache.n_saved, p0);
+}
+
+// Initializes cache with room for given amount of tokens as a copy of the tokens in src, as far as they fit
+bool mpt_kv_cache_copy(const mpt_hparams & hparams, const mpt_kv_cache & src, mpt_kv_cache & cache, int n_ctx) {
+    const int n_embd  = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
+
+    if (!mpt_kv_cache_init(hparams, cache, src.k->type, n_ctx, src.n_ctx_max)) {
+        return false;
+    }
+    cache.n = std::min(src.n, n_ctx);
+
+    const size_t row_size = ggml_element_size(src.k)*n_embd;
+    const size_t v_size = ggml_element_size(src.v);
+
+    for (int il = 0; il < n_layer; il++) {
+        // Copy rows of kept tokens
+        memcpy(reinterpret_cast<uint8_t*>(cache.k->data) + size_t(il)*n_ctx*row_size,
+               reinterpret_cast<uint8_t*>(src.k->data) + size_t(il)*src.n_ctx*row_size,
+               cache.n*row_size);
+        // V is transposed, so kept tokens need to be copied in every dimension
+        for (int dim = 0; dim < n_embd; dim++) {
+            memcpy(reinterpret_cast<uint8_t*>(cache.v->data) + size_t(il*n_embd + dim)*n_ctx*v_size,
+                   reinterpret_cast<uint8_t*>(src.v->data) + size_t(il*n_embd + dim)*src.n_ctx*v_size,
+                   cache.n*v_size);
+        }
+    }
+
+    return true;
+}
+
+// Reallocates the cache with room for given amount of tokens, keeping the ones it contains as far as they fit
+bool mpt_kv_cache_resize(const mpt_hparams & hparams, mpt_kv_cache & cache, int n_ctx) {
+    mpt_kv_cache resized;
+    if (!mpt_kv_cache_copy(hparams, cache, resized, n_ctx)) {
+        return false;
+    }
+
+    // Swap old cache out, it is freed along with resized
+    std::swap(cache.k, resized.k);
+    std::swap(cache.v, resized.v);
+    std::swap(cache.ctx, resized.ctx);
+    std::swap(cache.buf.addr, resized.buf.addr);
+    std::swap(cache.buf.size, resized.buf.size);
+    cache.n       = resized.n;
+    cache.n_saved = std::min(cache.n_saved, cache.n);
+    cache.n_ctx   = resized.n_ctx;
+
     return true;
 }
 
 // load the model's weights from a stream
-bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & model, gpt_vocab & vocab) {
+bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & model, gpt_vocab & vocab, bool use_mmap, bool use_mlock) {
     printf("%s: loading model from '%s' - please wait ...\n", __func__, fname.c_str());
 
     // verify magic
@@ -123,6 +207,8 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
                 vocab.add_special_token(word);
             }
         }
+
+        gpt_vocab_finalize(vocab);
     }
 
     // for the big tensors, we have the option to store the data in 16-bit floats or quantized
@@ -145,13 +231,13 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
     auto & ctx = model.ctx;
 
     size_t ctx_size = 0;
+    size_t ctx_overhead = 0;
 
     {
         const auto & hparams = model.hparams;
 
         const int n_embd  = hparams.n_embd;
         const int n_layer = hparams.n_layer;
-        const int n_ctx   = hparams.n_ctx;
         const int n_vocab = hparams.n_vocab;
         const int expand  = hparams.expand;
 
@@ -169,21 +255,28 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
         ctx_size += n_layer*(expand*n_embd*n_embd*ggml_type_sizef(wtype));  // ffn_up_proj_w
         ctx_size += n_layer*(expand*n_embd*n_embd*ggml_type_sizef(wtype)); // ffn_down_proj_w
 
-        ctx_size += n_ctx*n_layer*n_embd*ggml_type_sizef(GGML_TYPE_F16); // memory_k
-        ctx_size += n_ctx*n_layer*n_embd*ggml_type_sizef(GGML_TYPE_F16); // memory_v
-
         // TODO probably less now?
-        ctx_size += (5 + 10*n_layer)*256; // object overhead
+        ctx_overhead = (5 + 10*n_layer)*256;
+        ctx_size += ctx_overhead; // object overhead
 
         printf("%s: ggml ctx size = %6.2f MB\n", __func__, ctx_size/(1024.0*1024.0));
     }
 
+    // map the model file, tensors will point into the mapping instead of being read
+    if (use_mmap) {
+        model.mapping = std::make_unique<gpt_mmap>();
+        if (!model.mapping->map(fname, true, use_mlock)) {
+            fprintf(stderr, "%s: failed to map '%s', reading it instead\n", __func__, fname.c_str());
+            model.mapping = nullptr;
+        }
+    }
+
     // create the ggml context
     {
         struct ggml_init_params params = {
-            .mem_size   = ctx_size,
+            .mem_size   = model.mapping ? ctx_overhead : ctx_size,
             .mem_buffer = NULL,
-            .no_alloc   = false,
+            .no_alloc   = bool(model.mapping),
         };
 
         model.ctx = ggml_init(params);
@@ -233,20 +326,6 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
         }
     }
 
-    // key + value memory
-    {
-        const auto & hparams = model.hparams;
-
-        if (!kv_cache_init(hparams, model.kv_self, GGML_TYPE_F16, model.hparams.n_ctx)) {
-            fprintf(stderr, "%s: kv_cache_init() failed for self-attention cache\n", __func__);
-            ggml_free(ctx);
-            return false;
-        }
-
-        const size_t memory_size = ggml_nbytes(model.kv_self.k) + ggml_nbytes(model.kv_self.v);
-        printf("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
-    }
-
     // load weights
     {
         int n_tensors = 0;
@@ -307,7 +386,23 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
                 return false;
             }
 
-            fin.read(reinterpret_cast<char *>(tensor->data), ggml_nbytes(tensor));
+            if (model.mapping) {
+                const size_t offset = fin.tellg();
+                if (offset + ggml_nbytes(tensor) > model.mapping->size) {
+                    fprintf(stderr, "%s: tensor '%s' exceeds end of model file\n", __func__, name.data());
+                    return false;
+                }
+                // point tensor into mapping if its data is aligned to its elements, copy it otherwise
+                auto data = static_cast<uint8_t *>(model.mapping->addr) + offset;
+                if (offset % sizeof(float) == 0) {
+                    tensor->data = data;
+                } else {
+                    tensor->data = model.unaligned_data.emplace_back(data, data + ggml_nbytes(tensor)).data();
+                }
+                fin.seekg(ggml_nbytes(tensor), std::ios::cur);
+            } else {
+                fin.read(reinterpret_cast<char *>(tensor->data), ggml_nbytes(tensor));
+            }
 
             //printf("%42s - [%5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ttype == 0 ? "float" : "f16", ggml_nbytes(tensor)/1024.0/1024.0);
             total_size += ggml_nbytes(tensor);
@@ -326,7 +421,7 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
 }
 
 // load the model's weights from a file path
-bool mpt_model_load(const std::string & fname, mpt_model & model, gpt_vocab & vocab) {
+bool mpt_model_load(const std::string & fname, mpt_model & model, gpt_vocab & vocab, bool use_mmap, bool use_mlock) {
 
     auto fin = std::ifstream(fname, std::ios::binary);
     if (!fin) {
@@ -334,47 +429,62 @@ bool mpt_model_load(const std::string & fname, mpt_model & model, gpt_vocab & vo
         return false;
     }
 
-    bool loaded = mpt_model_load(fname, fin, model, vocab);
+    bool loaded = mpt_model_load(fname, fin, model, vocab, use_mmap, use_mlock);
     fin.close();
     return loaded;
 }
 
 bool mpt_eval(
-        mpt_model & model,
+        const mpt_model & model,
+              mpt_kv_cache & kv_self,
+              mpt_buffer & buf,
         const int n_threads,
         const int n_past,
         const std::vector<int>           & embd_inp,
               std::vector<float>         & embd_w,
-              size_t                     & mem_per_token) {
+              size_t                     & mem_per_token,
+              bool                         all_logits) {
     const int N = embd_inp.size();
 
     const auto & hparams = model.hparams;
 
     const int n_embd  = hparams.n_embd;
     const int n_layer = hparams.n_layer;
-    const int n_ctx   = hparams.n_ctx;
     const int n_head  = hparams.n_head;
     const int n_vocab = hparams.n_vocab;
 
+    // grow kv cache geometrically if it's too small
+    // tokens from n_past on are (re)written
+    kv_self.n_saved = std::min(kv_self.n_saved, n_past);
+
+    if (n_past + N > kv_self.n_ctx) {
+        const int n_ctx_new = std::min(kv_self.n_ctx_max, std::max(n_past + N, 2*kv_self.n_ctx));
+        if (n_past + N > n_ctx_new || !mpt_kv_cache_resize(hparams, kv_self, n_ctx_new)) {
+            fprintf(stderr, "%s: not enough space in kv cache for %d tokens\n", __func__, n_past + N);
+            return false;
+        }
+    }
+    const int n_ctx = kv_self.n_ctx;
+
     const size_t init_buf_size = 1024_MiB;
-    if (!model.buf.addr || model.buf.size < init_buf_size)
-        model.buf.resize(init_buf_size);
+    if (!buf.addr || buf.size < init_buf_size)
+        buf.resize(init_buf_size);
 
-    if (mem_per_token > 0 && mem_per_token*N > model.buf.size) {
+    if (mem_per_token > 0 && mem_per_token*N > buf.size) {
         const size_t buf_size_new = 1.1*(mem_per_token*N); // add 10% to account for ggml object overhead
-        // printf("\n%s: reallocating buffer from %zu to %zu bytes\n", __func__, model.buf.size, buf_size_new);
+        // printf("\n%s: reallocating buffer from %zu to %zu bytes\n", __func__, buf.size, buf_size_new);
 
         // reallocate
-        model.buf.resize(buf_size_new);
-        if (model.buf.addr == nullptr) {
-            fprintf(stderr, "%s: failed to allocate %zu bytes\n", __func__, model.buf.size);
+        buf.resize(buf_size_new);
+        if (buf.addr == nullptr) {
+            fprintf(stderr, "%s: failed to allocate %zu bytes\n", __func__, buf.size);
             return false;
         }
     }
 
     struct ggml_init_params params = {
-        model.buf.size,
-        model.buf.addr,
+        buf.size,
+        buf.addr,
         false
     };
 
@@ -414,10 +524,10 @@ bool mpt_eval(
             {
                 Vcur = ggml_transpose(ctx0, Vcur);
 
-                struct ggml_tensor * k = ggml_view_1d(ctx0, model.kv_self.k, N*n_embd, (ggml_element_size(model.kv_self.k)*n_embd)*(il*n_ctx + n_past));
-                struct ggml_tensor * v = ggml_view_2d(ctx0, model.kv_self.v, N, n_embd,
-                                        (   n_ctx)*ggml_element_size(model.kv_self.v),
-                                        (il*n_ctx)*ggml_element_size(model.kv_self.v)*n_embd + n_past*ggml_element_size(model.kv_self.v));
+                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_embd, (ggml_element_size(kv_self.k)*n_embd)*(il*n_ctx + n_past));
+                struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, N, n_embd,
+                                        (   n_ctx)*ggml_element_size(kv_self.v),
+                                        (il*n_ctx)*ggml_element_size(kv_self.v)*n_embd + n_past*ggml_element_size(kv_self.v));
 
                 ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur, k));
                 ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcur, v));
@@ -431,7 +541,7 @@ bool mpt_eval(
             struct ggml_tensor * K =
                 ggml_permute(ctx0,
                         ggml_reshape_3d(ctx0,
-                            ggml_view_1d(ctx0, model.kv_self.k, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(model.kv_self.k)*n_embd),
+                            ggml_view_1d(ctx0, kv_self.k, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(kv_self.k)*n_embd),
                             n_embd/n_head, n_head, n_past + N),
                         0, 2, 1, 3);
 
@@ -457,11 +567,11 @@ bool mpt_eval(
 
             // V_trans = Vmem.view(n_embd/n_head, n_head, n_past + N).permute(1, 2, 0, 3).contiguous()
             struct ggml_tensor * V =
-                ggml_view_3d(ctx0, model.kv_self.v,
+                ggml_view_3d(ctx0, kv_self.v,
                         n_past + N, n_embd/n_head, n_head,
-                        n_ctx*ggml_element_size(model.kv_self.v),
-                        n_ctx*ggml_element_size(model.kv_self.v)*n_embd/n_head,
-                        il*n_ctx*ggml_element_size(model.kv_self.v)*n_embd);
+                        n_ctx*ggml_element_size(kv_self.v),
+                        n_ctx*ggml_element_size(kv_self.v)*n_embd/n_head,
+                        il*n_ctx*ggml_element_size(kv_self.v)*n_embd);
 
             // KQV = transpose(V) * KQ_soft_max
             struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
@@ -522,9 +632,17 @@ bool mpt_eval(
     ggml_graph_compute       (ctx0, &gf);
 
 
-    // return result for just the last token
-    embd_w.resize(n_vocab);
-    memcpy(embd_w.data(), (float *) ggml_get_data(out) + (n_vocab*(N-1)), sizeof(float)*n_vocab);
+    if (all_logits) {
+        // return result for all tokens
+        embd_w.resize(n_vocab*N);
+        memcpy(embd_w.data(), ggml_get_data(out), sizeof(float)*n_vocab*N);
+    } else {
+        // return result for just the last token
+        embd_w.resize(n_vocab);
+        memcpy(embd_w.data(), (float *) ggml_get_data(out) + (n_vocab*(N-1)), sizeof(float)*n_vocab);
+    }
+
+    kv_self.n = n_past + N;
 
     if (mem_per_token == 0) {
         mem_per_token = ggml_used_mem(ctx0)/N;
@@ -537,109 +655,234 @@ bool mpt_eval(
 }
 
 
-#define MPT_MAX_RNG_STATE 64*1024
+// the state consists of 32 bit words (rng state size, rng state, kv cache type, amount of tokens in kv cache)
+// followed by the first kv_self.n tokens of the kv cache
+// kv cache type in state header if the kv cache has been quantized to blocks of a scale followed by 8 bit values
+static const uint32_t mpt_state_kv_q8 = 0x10000;
+static const size_t mpt_q8_block_size = 32;
 
-size_t mpt_get_state_size(const mpt_model &model)
+static bool mpt_state_quantizable(const mpt_kv_cache &kv_self)
 {
-    // we don't know size of rng until we actually serialize it. so reserve more than enough memory for its serialized state.
-    // for reference, std::mt19937(1337) serializes to 6701 bytes.
-    const size_t s_rng_size        = sizeof(size_t);
-    const size_t s_rng             = MPT_MAX_RNG_STATE;
-    const size_t s_kv_size         = sizeof(size_t);
-    const size_t s_kv_ntok         = sizeof(int);
-    const size_t s_kv              = model.kv_self.buf.size;
-    const size_t s_total = (
-        + s_rng_size
-        + s_rng
-        + s_kv_size
-        + s_kv_ntok
-        + s_kv
-    );
-    fflush(stdout);
-    return s_total;
+    return kv_self.k->type == GGML_TYPE_F32 || kv_self.k->type == GGML_TYPE_F16;
 }
 
-size_t mpt_copy_state_data(const mpt_model &model, const std::mt19937 &rng, uint8_t *dest)
+static size_t mpt_q8_size(size_t n)
 {
-    uint8_t * out = dest;
-    fflush(stdout);
-    // copy rng
-    {
-        std::stringstream rng_ss;
-        rng_ss << rng;
-
-        const size_t rng_size = rng_ss.str().size();
-        char rng_buf[MPT_MAX_RNG_STATE];
-
-        memset(&rng_buf[0], 0, MPT_MAX_RNG_STATE);
-        memcpy(&rng_buf[0], rng_ss.str().data(), rng_ss.str().size());
+    return (n + mpt_q8_block_size - 1)/mpt_q8_block_size*(sizeof(float) + mpt_q8_block_size);
+}
 
-        memcpy(out, &rng_size,   sizeof(rng_size));   out += sizeof(rng_size);
-        memcpy(out, &rng_buf[0], MPT_MAX_RNG_STATE); out += MPT_MAX_RNG_STATE;
+static void mpt_quantize_q8(ggml_type type, const uint8_t *src, size_t n, uint8_t *dst)
+{
+    std::vector<float> block(mpt_q8_block_size);
+    for (size_t i = 0; i < n; i += mpt_q8_block_size) {
+        const size_t n_block = std::min(mpt_q8_block_size, n - i);
+        float amax = 0.0f;
+        for (size_t j = 0; j < n_block; j++) {
+            block[j] = type == GGML_TYPE_F16 ? ggml_fp16_to_fp32(reinterpret_cast<const ggml_fp16_t *>(src)[i + j])
+                                             : reinterpret_cast<const float *>(src)[i + j];
+            amax = std::max(amax, std::fabs(block[j]));
+        }
+        const float scale = amax/127.0f;
+        const float iscale = scale != 0.0f ? 1.0f/scale : 0.0f;
+        memcpy(dst, &scale, sizeof(scale)); dst += sizeof(scale);
+        for (size_t j = 0; j < mpt_q8_block_size; j++) {
+            *dst++ = uint8_t(j < n_block ? int8_t(std::round(block[j]*iscale)) : 0);
+        }
     }
+}
 
-    // copy kv cache
-    {
-        const size_t kv_size = model.kv_self.buf.size;
-        const int    kv_ntok = model.kv_self.n;
-
-        memcpy(out, &kv_size, sizeof(kv_size)); out += sizeof(kv_size);
-        memcpy(out, &kv_ntok, sizeof(kv_ntok)); out += sizeof(kv_ntok);
-
-        if (kv_size) {
-            memcpy(out, model.kv_self.buf.addr, kv_size); out += kv_size;
+static void mpt_dequantize_q8(ggml_type type, const uint8_t *src, size_t n, uint8_t *dst)
+{
+    for (size_t i = 0; i < n; i += mpt_q8_block_size) {
+        const size_t n_block = std::min(mpt_q8_block_size, n - i);
+        float scale;
+        memcpy(&scale, src, sizeof(scale)); src += sizeof(scale);
+        for (size_t j = 0; j < n_block; j++) {
+            const float v = int8_t(src[j])*scale;
+            if (type == GGML_TYPE_F16) {
+                reinterpret_cast<ggml_fp16_t *>(dst)[i + j] = ggml_fp32_to_fp16(v);
+            } else {
+                reinterpret_cast<float *>(dst)[i + j] = v;
+            }
         }
+        src += mpt_q8_block_size;
     }
+}
 
-    const size_t written  = out - dest;
-    fflush(stdout);
-    return written;
+static std::vector<uint32_t> mpt_state_header(const mpt_kv_cache &kv_self, const std::mt19937 &rng, bool quantize = false)
+{
+    auto header = gpt_rng_save(rng);
+    header.insert(header.begin(), header.size());
+    header.push_back(quantize ? mpt_state_kv_q8 : uint32_t(kv_self.k->type));
+    header.push_back(kv_self.n);
+    return header;
 }
 
-size_t mpt_set_state_data(mpt_model *model, std::mt19937 *rng, const uint8_t *src)
+// calls fn(data, size) for every contiguous part of the kv cache holding tokens begin to kv_self.n
+template<typename Fn>
+static void mpt_state_chunks(const mpt_hparams &hparams, const mpt_kv_cache &kv_self, Fn &&fn, int begin = 0)
 {
-    const uint8_t * in = src;
+    const int n_embd  = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
+    const int n_ctx   = kv_self.n_ctx;
+    const size_t row_size = ggml_element_size(kv_self.k)*n_embd;
+    const size_t v_size = ggml_element_size(kv_self.v);
+
+    for (int il = 0; il < n_layer; il++) {
+        // keys are stored token by token
+        fn(reinterpret_cast<uint8_t*>(kv_self.k->data) + (size_t(il)*n_ctx + begin)*row_size, (kv_self.n - begin)*row_size);
+        // values are transposed, so tokens are stored dimension by dimension
+        for (int dim = 0; dim < n_embd; dim++) {
+            fn(reinterpret_cast<uint8_t*>(kv_self.v->data) + (size_t(il*n_embd + dim)*n_ctx + begin)*v_size, (kv_self.n - begin)*v_size);
+        }
+    }
+}
 
-    // set rng
-    {
-        size_t rng_size;
-        char   rng_buf[MPT_MAX_RNG_STATE];
+template<typename Write>
+static bool mpt_write_state(const mpt_hparams &hparams, const mpt_kv_cache &kv_self, const std::mt19937 &rng, Write &&write, bool quantize = false, int begin = 0)
+{
+    quantize = quantize && mpt_state_quantizable(kv_self);
+    const auto header = mpt_state_header(kv_self, rng, quantize);
+    if (!write(header.data(), header.size()*sizeof(uint32_t))) {
+        return false;
+    }
 
-        memcpy(&rng_size,   in, sizeof(rng_size));    in += sizeof(rng_size);
-        memcpy(&rng_buf[0], in, MPT_MAX_RNG_STATE); in += MPT_MAX_RNG_STATE;
+    bool ok = true;
+    std::vector<uint8_t> q8;
+    mpt_state_chunks(hparams, kv_self, [&] (uint8_t *data, size_t size) {
+        if (quantize) {
+            const size_t n = size/ggml_type_size(kv_self.k->type);
+            q8.resize(mpt_q8_size(n));
+            mpt_quantize_q8(kv_self.k->type, data, n, q8.data());
+            ok = ok && write(q8.data(), q8.size());
+        } else {
+            ok = ok && write(data, size);
+        }
+    }, begin);
+    return ok;
+}
 
-        std::stringstream rng_ss;
-        rng_ss.str(std::string(&rng_buf[0], rng_size));
-        rng_ss >> *rng;
+template<typename Read>
+static bool mpt_read_state(const mpt_hparams &hparams, mpt_kv_cache &kv_self, std::mt19937 &rng, Read &&read, int begin = 0)
+{
+    uint32_t rng_size;
+    if (!read(&rng_size, sizeof(rng_size)) || rng_size > std::mt19937::state_size + 1) {
+        return false;
+    }
+    std::vector<uint32_t> rng_state(rng_size);
+    uint32_t kv_type, kv_ntok;
+    if (!read(rng_state.data(), rng_size*sizeof(uint32_t)) || !read(&kv_type, sizeof(kv_type)) || !read(&kv_ntok, sizeof(kv_ntok))) {
+        return false;
+    }
 
-        assert(rng_ss.fail() == false);
+    const bool quantized = kv_type == mpt_state_kv_q8 && mpt_state_quantizable(kv_self);
+    if (kv_type != uint32_t(kv_self.k->type) && !quantized) {
+        fprintf(stderr, "%s: kv cache type of state differs\n", __func__);
+        return false;
+    }
+    if (!gpt_rng_load(rng, rng_state)) {
+        fprintf(stderr, "%s: invalid rng state\n", __func__);
+        return false;
     }
 
-    // set kv cache
-    {
-        size_t kv_size;
-        int kv_ntok;
+    // tokens before begin are kept
+    if (begin > kv_self.n || int(kv_ntok) < begin) {
+        fprintf(stderr, "%s: state delta does not match kv cache\n", __func__);
+        return false;
+    }
+    kv_self.n = begin;
+    kv_self.n_saved = std::min(kv_self.n_saved, begin);
 
-        memcpy(&kv_size, in, sizeof(kv_size)); in += sizeof(kv_size);
-        memcpy(&kv_ntok, in, sizeof(kv_ntok)); in += sizeof(kv_ntok);
+    // make room for the tokens, the cache may have been larger when the state was copied
+    if (int(kv_ntok) > kv_self.n_ctx && !mpt_kv_cache_resize(hparams, kv_self, kv_ntok)) {
+        return false;
+    }
+    kv_self.n = kv_ntok;
+
+    bool ok = true;
+    std::vector<uint8_t> q8;
+    mpt_state_chunks(hparams, kv_self, [&] (uint8_t *data, size_t size) {
+        if (quantized) {
+            const size_t n = size/ggml_type_size(kv_self.k->type);
+            q8.resize(mpt_q8_size(n));
+            ok = ok && read(q8.data(), q8.size());
+            if (ok) mpt_dequantize_q8(kv_self.k->type, q8.data(), n, data);
+        } else {
+            ok = ok && read(data, size);
+        }
+    }, begin);
+    return ok;
+}
 
-        if (kv_size) {
-            assert(model->kv_self.buf.size == kv_size);
+size_t mpt_get_state_size(const mpt_hparams &hparams, const mpt_kv_cache &kv_self, const std::mt19937 &rng)
+{
+    size_t size = mpt_state_header(kv_self, rng).size()*sizeof(uint32_t);
+    mpt_state_chunks(hparams, kv_self, [&] (uint8_t *, size_t chunk_size) {
+        size += chunk_size;
+    });
+    return size;
+}
 
-            void * k_data = model->kv_self.k->data; // remember data pointers
-            void * v_data = model->kv_self.v->data; // because their value is stored in buf and overwritten by memcpy
+size_t mpt_copy_state_data(const mpt_hparams &hparams, const mpt_kv_cache &kv_self, const std::mt19937 &rng, uint8_t *dest)
+{
+    uint8_t * out = dest;
+    mpt_write_state(hparams, kv_self, rng, [&] (const void *data, size_t size) {
+        memcpy(out, data, size); out += size;
+        return true;
+    });
+    return out - dest;
+}
 
-            memcpy(model->kv_self.buf.addr, in, kv_size); in += kv_size;
+size_t mpt_set_state_data(const mpt_hparams &hparams, mpt_kv_cache *kv_self, std::mt19937 *rng, const uint8_t *src)
+{
+    const uint8_t * in = src;
+    const bool ok = mpt_read_state(hparams, *kv_self, *rng, [&] (void *data, size_t size) {
+        memcpy(data, in, size); in += size;
+        return true;
+    });
+    return ok ? in - src : 0;
+}
 
-            model->kv_self.k->data = k_data; // restore correct data pointers
-            model->kv_self.v->data = v_data;
+bool mpt_write_state_data(const mpt_hparams &hparams, const mpt_kv_cache &kv_self, const std::mt19937 &rng, std::ostream &out, bool quantize)
+{
+    return mpt_write_state(hparams, kv_self, rng, [&] (const void *data, size_t size) {
+        return bool(out.write(reinterpret_cast<const char *>(data), size));
+    }, quantize);
+}
 
-        }
+bool mpt_read_state_data(const mpt_hparams &hparams, mpt_kv_cache *kv_self, std::mt19937 *rng, std::istream &in)
+{
+    return mpt_read_state(hparams, *kv_self, *rng, [&] (void *data, size_t size) {
+        return bool(in.read(reinterpret_cast<char *>(data), size));
+    });
+}
 
-        model->kv_self.n = kv_ntok;
+bool mpt_write_state_delta(const mpt_hparams &hparams, mpt_kv_cache &kv_self, const std::mt19937 &rng, std::ostream &out, bool quantize, bool full)
+{
+    const uint32_t begin = full ? 0 : std::min(kv_self.n_saved, kv_self.n);
+    if (!out.write(reinterpret_cast<const char *>(&begin), sizeof(begin))) {
+        return false;
+    }
+    const bool ok = mpt_write_state(hparams, kv_self, rng, [&] (const void *data, size_t size) {
+        return bool(out.write(reinterpret_cast<const char *>(data), size));
+    }, quantize, begin);
+    if (ok) {
+        kv_self.n_saved = kv_self.n;
     }
+    return ok;
+}
 
-    const size_t nread    = in - src;
-    fflush(stdout);
-    return nread;
+bool mpt_read_state_delta(const mpt_hparams &hparams, mpt_kv_cache *kv_self, std::mt19937 *rng, std::istream &in)
+{
+    uint32_t begin;
+    if (!in.read(reinterpret_cast<char *>(&begin), sizeof(begin))) {
+        return false;
+    }
+    const bool ok = mpt_read_state(hparams, *kv_self, *rng, [&] (void *data, size_t size) {
+        return bool(in.read(reinterpret_cast<char *>(data), size));
+    }, begin);
+    if (ok) {
+        kv_self->n_saved = kv_self->n;
+    }
+    return ok;
 }
@@ -5,6 +5,7 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
 #include <random>
 #include <ggml.h>
 
@@ -61,6 +62,9 @@ struct mpt_kv_cache {
     mpt_buffer buf;
 
     int n; // number of tokens currently in the cache
+    int n_ctx = 0; // number of tokens there is room for
+    int n_ctx_max = 0; // number of tokens the cache may grow to during evaluation
+    int n_saved = 0; // number of leading tokens unchanged since the state was last written or read by mpt_write_state_delta()/mpt_read_state_delta()
 
     ~mpt_kv_cache() {
         if (ctx) {
@@ -81,11 +85,12 @@ struct mpt_model {
 
     std::vector<mpt_layer> layers;
 
-    struct mpt_kv_cache kv_self;
     struct ggml_context * ctx;
     std::map<std::string, struct ggml_tensor *> tensors;
 
-    mpt_buffer buf;
+    // only set if the model file is mapped, tensors then point into it
+    std::unique_ptr<gpt_mmap> mapping;
+    std::vector<std::vector<uint8_t>> unaligned_data;
 
     ~mpt_model() {
         if (ctx) {
@@ -95,9 +100,20 @@ struct mpt_model {
 };
 
 
-bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & model, gpt_vocab& vocab);
-bool mpt_eval(mpt_model& model, const int n_threads, const int n_past, const std::vector<int>& embd_inp, std::vector<float>& embd_w, size_t& mem_per_token);
-size_t mpt_get_state_size(const mpt_model &model);
-size_t mpt_copy_state_data(const mpt_model &model, const std::mt19937& rng, uint8_t *dest);
-size_t mpt_set_state_data(mpt_model *model, std::mt19937 *rng, const uint8_t *src);
+bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & model, gpt_vocab & vocab, bool use_mmap = false, bool use_mlock = false);
+bool mpt_kv_cache_init(const mpt_hparams & hparams, mpt_kv_cache & cache, ggml_type wtype, int n_ctx, int n_ctx_max = 0);
+bool mpt_kv_cache_copy(const mpt_hparams & hparams, const mpt_kv_cache & src, mpt_kv_cache & cache, int n_ctx);
+bool mpt_kv_cache_resize(const mpt_hparams & hparams, mpt_kv_cache & cache, int n_ctx);
+void mpt_kv_cache_erase(const mpt_hparams & hparams, mpt_kv_cache & cache, int p0, int p1);
+bool mpt_eval(const mpt_model& model, mpt_kv_cache& kv_self, mpt_buffer& buf, const int n_threads, const int n_past, const std::vector<int>& embd_inp, std::vector<float>& embd_w, size_t& mem_per_token, bool all_logits = false);
+size_t mpt_get_state_size(const mpt_hparams &hparams, const mpt_kv_cache &kv_self, const std::mt19937 &rng);
+size_t mpt_copy_state_data(const mpt_hparams &hparams, const mpt_kv_cache &kv_self, const std::mt19937 &rng, uint8_t *dest);
+size_t mpt_set_state_data(const mpt_hparams &hparams, mpt_kv_cache *kv_self, std::mt19937 *rng, const uint8_t *src);
+// quantize stores an F32 or F16 kv cache at 8 bits per element, mpt_read_state_data() converts it back
+bool mpt_write_state_data(const mpt_hparams &hparams, const mpt_kv_cache &kv_self, const std::mt19937 &rng, std::ostream &out, bool quantize = false);
+// Writes only tokens changed since the last delta (or all of them if full is set) along with the rng state
+// Reading the deltas in order restores the state, starting from an empty kv cache or one holding the state of the first one
+bool mpt_write_state_delta(const mpt_hparams &hparams, mpt_kv_cache &kv_self, const std::mt19937 &rng, std::ostream &out, bool quantize, bool full);
+bool mpt_read_state_delta(const mpt_hparams &hparams, mpt_kv_cache *kv_self, std::mt19937 *rng, std::istream &in);
+bool mpt_read_state_data(const mpt_hparams &hparams, mpt_kv_cache *kv_self, std::mt19937 *rng, std::istream &in);
 #endif // MPT_H
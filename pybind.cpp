@@ -16,6 +16,7 @@ PYBIND11_MODULE(justlm_py, m) {
         .def_readonly("seed", &Inference::Params::seed)
         .def_readwrite("n_threads", &Inference::Params::n_threads)
         .def_readwrite("n_ctx", &Inference::Params::n_ctx)
+        .def_readwrite("n_ctx_initial", &Inference::Params::n_ctx_initial)
         .def_readwrite("n_ctx_window_top_bar", &Inference::Params::n_ctx_window_top_bar)
         .def_readwrite("n_batch", &Inference::Params::n_batch)
         .def_readwrite("n_repeat_last", &Inference::Params::n_repeat_last)
@@ -25,6 +26,12 @@ PYBIND11_MODULE(justlm_py, m) {
         .def_readwrite("temp", &Inference::Params::temp)
         .def_readwrite("repeat_penalty", &Inference::Params::repeat_penalty)
         .def_readwrite("eos_ignores", &Inference::Params::n_eos_ignores)
+        .def_readwrite("n_lookup_ngram", &Inference::Params::n_lookup_ngram)
+        .def_readwrite("n_lookup_draft", &Inference::Params::n_lookup_draft)
+        .def_readwrite("n_seq_max", &Inference::Params::n_seq_max)
+        .def_readwrite("n_kv_bits", &Inference::Params::n_kv_bits)
+        .def_readwrite("quantize_serialized_kv", &Inference::Params::quantize_serialized_kv)
+        .def_readwrite("use_mmap", &Inference::Params::use_mmap)
         .def_readwrite("use_mlock", &Inference::Params::use_mlock)
         .def_readwrite("prefer_mirostat", &Inference::Params::prefer_mirostat)
         .def_readwrite("mirostat_learning_rate", &Inference::Params::mirostat_learning_rate)
@@ -32,25 +39,47 @@ PYBIND11_MODULE(justlm_py, m) {
     py::class_<Inference>(m, "Inference")
         .def_static("construct", &Inference::construct, py::arg("weights_path"), py::arg("params") = Inference::Params())
         .def("append", &Inference::append, py::arg("prompt"), py::arg("on_tick") = nullptr)
+        .def("set_prompt", &Inference::set_prompt, py::arg("prompt"), py::arg("on_tick") = nullptr)
         .def("run", &Inference::run, py::arg("end") = "", py::arg("on_tick") = nullptr, py::arg("pre_tick") = nullptr)
+        .def("generate", &Inference::generate, py::arg("end") = "", py::keep_alive<0, 1>())
         .def("create_savestate", &Inference::create_savestate)
         .def("restore_savestate", &Inference::restore_savestate)
+        .def("rewind", &Inference::rewind, py::arg("n_tokens"))
         .def("get_prompt", &Inference::get_prompt)
         .def("get_context_size", &Inference::get_context_size)
+        .def("get_memory_usage", &Inference::get_memory_usage)
+        .def("reset", &Inference::reset)
         .def("is_mirostat_available", &Inference::is_mirostat_available)
         .def("is_grammar_available", &Inference::is_grammar_available)
+        .def("is_multi_sequence_available", &Inference::is_multi_sequence_available)
+        .def("create_sequence", &Inference::create_sequence, py::arg("params") = Inference::Params())
+        .def("fork", &Inference::fork)
+        .def("run_sequences", &Inference::run_sequences, py::arg("sequences"), py::arg("end") = "", py::arg("on_tick") = nullptr)
+        .def("run_n", &Inference::run_n, py::arg("n"), py::arg("end") = "", py::arg("on_tick") = nullptr)
+        .def("run_beam_search", &Inference::run_beam_search, py::arg("n_beams"), py::arg("end") = "", py::arg("length_penalty") = 1.0f, py::arg("early_stopping") = true)
         .def("load_grammar", &Inference::load_grammar)
         .def("unload_grammar", &Inference::unload_grammar)
         .def_readwrite("params", &Inference::params);
+    py::class_<Generation>(m, "Generation")
+        .def("step", &Generation::step, py::arg("on_tick") = nullptr, py::arg("pre_tick") = nullptr)
+        .def("get_result", &Generation::get_result)
+        .def("is_done", &Generation::is_done)
+        .def("cancel", &Generation::cancel);
     py::class_<Inference::Savestate>(m, "Savestate")
         .def(py::init<>());
 
     py::class_<InferencePool>(m, "InferencePool")
-        .def(py::init<size_t, const std::string&, bool>(), py::arg("size"), py::arg("pool_name"), py::arg("clean_up") = true)
-        .def("create_inference", &InferencePool::create_inference, py::arg("id"), py::arg("weights_path"), py::arg("parameters"), py::return_value_policy::reference_internal)
+        .def(py::init<size_t, const std::string&, bool, size_t>(), py::arg("size"), py::arg("pool_name"), py::arg("clean_up") = true, py::arg("max_pending_writes") = 2)
+        .def("create_inference", py::overload_cast<size_t, const std::string&, const Inference::Params&>(&InferencePool::create_inference), py::arg("id"), py::arg("weights_path"), py::arg("parameters"), py::return_value_policy::reference_internal)
         .def("get_inference", &InferencePool::get_inference, py::arg("id"), py::return_value_policy::reference_internal)
-        .def("get_or_create_inference", &InferencePool::create_inference, py::arg("id"), py::arg("weights_path"), py::arg("parameters"), py::return_value_policy::reference_internal)
+        .def("get_or_create_inference", &InferencePool::get_or_create_inference, py::arg("id"), py::arg("weights_path"), py::arg("parameters"), py::return_value_policy::reference_internal)
         .def("delete_inference", &InferencePool::delete_inference, py::arg("id"))
         .def("store_all", &InferencePool::store_all)
-        .def("get_active_slot_ids", &InferencePool::get_active_slot_ids);
+        .def("get_active_slot_ids", &InferencePool::get_active_slot_ids)
+        .def("get_failed_write_count", &InferencePool::get_failed_write_count)
+        .def("set_memory_budget", &InferencePool::set_memory_budget, py::arg("bytes"))
+        .def("get_memory_usage", &InferencePool::get_memory_usage)
+        .def("set_pinned", &InferencePool::set_pinned, py::arg("id"), py::arg("pinned") = true)
+        .def("set_slot_compression", &InferencePool::set_slot_compression, py::arg("compress"), py::arg("quantize_kv") = false)
+        .def("set_max_spare_instances", &InferencePool::set_max_spare_instances, py::arg("n"));
 }
@@ -0,0 +1,209 @@
+#include "slot_codec.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+
+
+
+namespace {
+// Sequences are a token (literal count << 4 | match length - min_match), literals, a 16 bit offset and a match length
+// Counts of 15 or more continue in bytes that are added up until one isn't 255, the last sequence has no match
+constexpr size_t min_match = 4;
+constexpr size_t max_offset = 0xFFFF;
+constexpr unsigned hash_bits = 14;
+// Matches never reach into the last bytes, which are left as literals
+constexpr size_t end_literals = 8;
+
+uint32_t read32(const char *p) {
+    uint32_t fres;
+    memcpy(&fres, p, sizeof(fres));
+    return fres;
+}
+
+uint32_t hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - hash_bits);
+}
+
+char *write_count(char *op, size_t count) {
+    for (; count >= 255; count -= 255) *op++ = char(255);
+    *op++ = char(count);
+    return op;
+}
+
+char *write_sequence(char *op, const char *literals, size_t n_literals, size_t offset, size_t match_len) {
+    const size_t match_count = match_len?match_len-min_match:0;
+    *op++ = char((std::min<size_t>(n_literals, 15) << 4) | std::min<size_t>(match_count, 15));
+    if (n_literals >= 15) op = write_count(op, n_literals-15);
+    memcpy(op, literals, n_literals);
+    op += n_literals;
+    if (match_len) {
+        *op++ = char(offset & 0xFF);
+        *op++ = char(offset >> 8);
+        if (match_count >= 15) op = write_count(op, match_count-15);
+    }
+    return op;
+}
+}
+
+
+size_t LM::SlotCodec::get_max_compressed_size(size_t src_size) {
+    return src_size + src_size/255 + 16;
+}
+
+size_t LM::SlotCodec::compress(const char *src, size_t src_size, char *dst) {
+    // Positions of last occurences of 4 byte sequences plus 1, 0 if none
+    std::vector<uint32_t> table(1 << hash_bits, 0);
+    const char *ip = src,
+               *anchor = src;
+    const char *const match_limit = src_size > end_literals?src+src_size-end_literals:src;
+    char *op = dst;
+    while (ip + min_match <= match_limit) {
+        const auto h = hash(read32(ip));
+        const auto ref = table[h];
+        table[h] = uint32_t(ip-src) + 1;
+        if (ref) {
+            const char *match = src + ref - 1;
+            if (size_t(ip-match) <= max_offset && read32(match) == read32(ip)) {
+                size_t len = min_match;
+                while (ip + len < match_limit && match[len] == ip[len]) len++;
+                op = write_sequence(op, anchor, ip-anchor, ip-match, len);
+                ip += len;
+                anchor = ip;
+                continue;
+            }
+        }
+        // Skip through data that doesn't compress faster and faster
+        ip += 1 + ((ip-anchor) >> 6);
+    }
+    op = write_sequence(op, anchor, src+src_size-anchor, 0, 0);
+    return op-dst;
+}
+
+bool LM::SlotCodec::decompress(const char *src, size_t src_size, char *dst, size_t dst_size) {
+    auto ip = reinterpret_cast<const uint8_t*>(src);
+    const auto iend = ip + src_size;
+    char *op = dst;
+    char *const oend = dst + dst_size;
+    auto read_count = [&] (size_t& count) {
+        uint8_t b;
+        do {
+            if (ip == iend) return false;
+            b = *ip++;
+            count += b;
+        } while (b == 255);
+        return true;
+    };
+    while (ip != iend) {
+        const uint8_t token = *ip++;
+        // Copy literals
+        size_t n_literals = token >> 4;
+        if (n_literals == 15 && !read_count(n_literals)) return false;
+        if (size_t(iend-ip) < n_literals || size_t(oend-op) < n_literals) return false;
+        memcpy(op, ip, n_literals);
+        op += n_literals;
+        ip += n_literals;
+        // Last sequence has no match
+        if (ip == iend) break;
+        // Copy match, byte by byte since it may overlap with output
+        if (iend-ip < 2) return false;
+        const size_t offset = ip[0] | (size_t(ip[1]) << 8);
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && !read_count(match_len)) return false;
+        match_len += min_match;
+        if (offset == 0 || size_t(op-dst) < offset || size_t(oend-op) < match_len) return false;
+        const char *match = op - offset;
+        for (size_t it = 0; it != match_len; it++) op[it] = match[it];
+        op += match_len;
+    }
+    return op == oend;
+}
+
+
+LM::SlotCodec::CompressingStreambuf::CompressingStreambuf(std::ostream& out)
+        : out(out), buf(chunk_size), compressed(get_max_compressed_size(chunk_size)) {
+    out.write(magic, sizeof(magic));
+    setp(buf.data(), buf.data()+buf.size());
+}
+
+bool LM::SlotCodec::CompressingStreambuf::write_chunk() {
+    const uint32_t raw_size = pptr()-pbase();
+    if (raw_size == 0) return true;
+    // Compress chunk, storing it as is if that didn't help
+    uint32_t stored_size = compress(buf.data(), raw_size, compressed.data());
+    const char *data = compressed.data();
+    if (stored_size >= raw_size) {
+        stored_size = raw_size;
+        data = buf.data();
+    }
+    out.write(reinterpret_cast<const char*>(&raw_size), sizeof(raw_size));
+    out.write(reinterpret_cast<const char*>(&stored_size), sizeof(stored_size));
+    out.write(data, stored_size);
+    setp(buf.data(), buf.data()+buf.size());
+    return bool(out);
+}
+
+LM::SlotCodec::CompressingStreambuf::int_type LM::SlotCodec::CompressingStreambuf::overflow(int_type ch) {
+    if (!write_chunk()) return traits_type::eof();
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+bool LM::SlotCodec::CompressingStreambuf::finish() {
+    if (!write_chunk()) return false;
+    const uint32_t end = 0;
+    return bool(out.write(reinterpret_cast<const char*>(&end), sizeof(end)));
+}
+
+
+bool LM::SlotCodec::decompress_stream(std::istream& in, std::vector<char>& out, unsigned n_threads) {
+    struct Chunk {
+        size_t in_offset, out_offset;
+        uint32_t raw_size, stored_size;
+    };
+    // Read all chunks
+    std::vector<char> data;
+    std::vector<Chunk> chunks;
+    size_t out_size = 0;
+    for (;;) {
+        Chunk chunk;
+        if (!in.read(reinterpret_cast<char*>(&chunk.raw_size), sizeof(chunk.raw_size))) return false;
+        if (chunk.raw_size == 0) break;
+        if (chunk.raw_size > chunk_size) return false;
+        if (!in.read(reinterpret_cast<char*>(&chunk.stored_size), sizeof(chunk.stored_size))) return false;
+        if (chunk.stored_size > get_max_compressed_size(chunk.raw_size)) return false;
+        chunk.in_offset = data.size();
+        chunk.out_offset = out_size;
+        data.resize(data.size()+chunk.stored_size);
+        if (!in.read(data.data()+chunk.in_offset, chunk.stored_size)) return false;
+        out_size += chunk.raw_size;
+        chunks.push_back(chunk);
+    }
+    // Decompress them in parallel
+    out.resize(out_size);
+    std::atomic_size_t next_chunk = 0;
+    std::atomic_bool ok = true;
+    auto worker = [&] () {
+        for (size_t it; ok && (it = next_chunk++) < chunks.size();) {
+            const auto& chunk = chunks[it];
+            const char *src = data.data()+chunk.in_offset;
+            char *dst = out.data()+chunk.out_offset;
+            if (chunk.stored_size == chunk.raw_size) {
+                memcpy(dst, src, chunk.raw_size);
+            } else if (!decompress(src, chunk.stored_size, dst, chunk.raw_size)) {
+                ok = false;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    const size_t n_workers = std::max<size_t>(std::min<size_t>(n_threads, chunks.size()), 1);
+    for (size_t it = 1; it < n_workers; it++) threads.emplace_back(worker);
+    worker();
+    for (auto& thread : threads) thread.join();
+    return ok;
+}
@@ -0,0 +1,53 @@
+#ifndef SLOT_CODEC_HPP
+#define SLOT_CODEC_HPP
+#include <iostream>
+#include <streambuf>
+#include <vector>
+#include <cstdint>
+
+
+
+// Fast LZ77 compression of pool slot files
+// A stream is the magic followed by chunks of [uint32 raw size, uint32 stored size, data], ended by a raw size of 0
+// Chunks are compressed independently so they can be decompressed in parallel, they are stored as is if they don't compress
+namespace LM {
+namespace SlotCodec {
+constexpr char magic[4] = {'J', 'L', 'M', 'Z'};
+constexpr size_t chunk_size = 1 << 20;
+
+size_t get_max_compressed_size(size_t src_size);
+// Returns compressed size, dst must have room for get_max_compressed_size(src_size) bytes
+size_t compress(const char *src, size_t src_size, char *dst);
+// Returns false if src is corrupt or doesn't decompress to exactly dst_size bytes
+bool decompress(const char *src, size_t src_size, char *dst, size_t dst_size);
+
+// Compresses everything written to it into given stream, finish() must be called once done
+class CompressingStreambuf final : public std::streambuf {
+    std::ostream& out;
+    std::vector<char> buf, compressed;
+
+    bool write_chunk();
+
+protected:
+    int_type overflow(int_type ch) override;
+
+public:
+    CompressingStreambuf(std::ostream& out);
+
+    // Writes remaining data and end of stream, returns false on error
+    bool finish();
+};
+
+// Reads stream following the magic, decompressing its chunks on up to n_threads threads. Returns false on error
+bool decompress_stream(std::istream& in, std::vector<char>& out, unsigned n_threads);
+
+// Reads from given memory
+class MemoryStreambuf final : public std::streambuf {
+public:
+    MemoryStreambuf(char *data, size_t size) {
+        setg(data, data, data+size);
+    }
+};
+}
+}
+#endif // SLOT_CODEC_HPP